@@ -0,0 +1,256 @@
+/***********************************************************
+ EMPCd - Event Music Player Client daemon
+ by Jeroen Massar <jeroen@massar.ch>
+************************************************************
+ Benchmarks, run with --benchmark
+***********************************************************/
+
+#include "empcd.h"
+#include "support/mpc-0.12.2/src/libmpdclient.h"
+
+static uint64_t bench_usec(const struct timespec *a, const struct timespec *b);
+static uint64_t bench_usec(const struct timespec *a, const struct timespec *b)
+{
+	return ((uint64_t)(b->tv_sec - a->tv_sec) * 1000000000 + b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static int bench_cmp(const void *a, const void *b);
+static int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void bench_print(const char *what, const char *where, uint64_t *t, unsigned int count);
+static void bench_print(const char *what, const char *where, uint64_t *t, unsigned int count)
+{
+	uint64_t	sum = 0;
+	unsigned int	i;
+
+	qsort(t, count, sizeof(*t), bench_cmp);
+	for (i = 0; i < count; i++) sum += t[i];
+
+	printf("%-8s %-30s n=%-6u min %6llu avg %6llu p50 %6llu p99 %6llu max %6llu usec\n",
+		what, where, count,
+		(unsigned long long)t[0],
+		(unsigned long long)(sum / count),
+		(unsigned long long)t[count / 2],
+		(unsigned long long)t[count * 99 / 100],
+		(unsigned long long)t[count - 1]);
+}
+
+/*
+ * Round-trip latency to MPD over whatever transport host selects:
+ * a path is a local socket, anything else TCP.
+ * 'ping' is the bare transport, 'status' is what a toggle key costs.
+ */
+int benchmark_latency(const char *host, unsigned int port, const char *password, unsigned int count)
+{
+	mpd_Connection	*m;
+	mpd_Status	s;
+	struct timespec	a, b;
+	uint64_t	*t;
+	unsigned int	i;
+	char		where[128];
+
+	if (count == 0) return 0;
+
+	if (host[0] == '/') snprintf(where, sizeof(where), "%s", host);
+	else snprintf(where, sizeof(where), "%s:%u", host, port);
+
+	t = calloc(count, sizeof(*t));
+	if (!t) return -1;
+
+	memset(&s, 0, sizeof(s));
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	m = mpd_newConnection(host, port, 10);
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	if (!m || m->error)
+	{
+		fprintf(stderr, "%s: %s\n", where, m ? m->errorStr : "out of memory");
+		if (m) mpd_closeConnection(m);
+		free(t);
+		return -1;
+	}
+
+	printf("connect  %-30s %llu usec\n", where, (unsigned long long)bench_usec(&a, &b));
+
+	if (password)
+	{
+		mpd_sendPasswordCommand(m, password);
+		mpd_finishCommand(m);
+	}
+
+	for (i = 0; i < count && !m->error; i++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		mpd_sendPingCommand(m);
+		mpd_finishCommand(m);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		t[i] = bench_usec(&a, &b);
+	}
+
+	if (!m->error) bench_print("ping", where, t, count);
+
+	for (i = 0; i < count && !m->error; i++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		mpd_sendStatusCommand(m);
+		mpd_fillStatus(m, &s);
+		mpd_finishCommand(m);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		t[i] = bench_usec(&a, &b);
+	}
+
+	mpd_finishStatus(&s);
+
+	if (!m->error) bench_print("status", where, t, count);
+
+	i = m->error;
+	if (i) fprintf(stderr, "%s: %s\n", where, m->errorStr);
+
+	mpd_closeConnection(m);
+	free(t);
+
+	return i ? -1 : 0;
+}
+
+/* CPU time of the process, what parsing and (de)allocating costs, not MPD generating the listing */
+static void bench_cpu(struct timespec *ts);
+static void bench_cpu(struct timespec *ts)
+{
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, ts);
+}
+
+/* One listallinfo, the songs kept like a client would: a copy each on the heap */
+static unsigned int bench_list_malloc(mpd_Connection *m, mpd_Song ***songs, unsigned int *size);
+static unsigned int bench_list_malloc(mpd_Connection *m, mpd_Song ***songs, unsigned int *size)
+{
+	mpd_InfoEntity	*entity;
+	mpd_Song	**grown;
+	unsigned int	n = 0, i;
+
+	mpd_sendListallInfoCommand(m, "");
+	while ((entity = mpd_getNextInfoEntity(m)) != NULL)
+	{
+		if (entity->type == MPD_INFO_ENTITY_TYPE_SONG)
+		{
+			if (n == *size)
+			{
+				grown = realloc(*songs, (*size ? *size * 2 : 1024) * sizeof(**songs));
+				if (!grown) break;
+				*songs = grown;
+				*size = *size ? *size * 2 : 1024;
+			}
+			(*songs)[n++] = mpd_songDup(entity->info.song);
+		}
+		mpd_freeInfoEntity(entity);
+	}
+	mpd_finishCommand(m);
+
+	for (i = 0; i < n; i++) mpd_freeSong((*songs)[i]);
+	return n;
+}
+
+/* The same with the arena, the entities themselves are kept and go with one reset */
+static unsigned int bench_list_arena(mpd_Connection *m, mpd_Arena *arena, mpd_Song ***songs, unsigned int *size);
+static unsigned int bench_list_arena(mpd_Connection *m, mpd_Arena *arena, mpd_Song ***songs, unsigned int *size)
+{
+	mpd_InfoEntity	*entity;
+	mpd_Song	**grown;
+	unsigned int	n = 0;
+
+	mpd_sendListallInfoCommand(m, "");
+	while ((entity = mpd_getNextInfoEntityArena(m, arena)) != NULL)
+	{
+		if (entity->type != MPD_INFO_ENTITY_TYPE_SONG) continue;
+
+		if (n == *size)
+		{
+			grown = realloc(*songs, (*size ? *size * 2 : 1024) * sizeof(**songs));
+			if (!grown) break;
+			*songs = grown;
+			*size = *size ? *size * 2 : 1024;
+		}
+		(*songs)[n++] = entity->info.song;
+	}
+	mpd_finishCommand(m);
+
+	mpd_resetArena(arena);
+	return n;
+}
+
+/*
+ * Fetch the whole library <count> times, alternating between the
+ * malloc per object allocator and the per-response arena.
+ */
+int benchmark_listing(const char *host, unsigned int port, const char *password, unsigned int count)
+{
+	mpd_Connection	*m;
+	mpd_Arena	arena;
+	mpd_Song	**songs = NULL;
+	struct timespec	a, b;
+	uint64_t	*tm, *ta;
+	unsigned int	i, size = 0, n = 0;
+	char		where[128];
+
+	if (count == 0) return 0;
+
+	if (host[0] == '/') snprintf(where, sizeof(where), "%s", host);
+	else snprintf(where, sizeof(where), "%s:%u", host, port);
+
+	tm = calloc(count, sizeof(*tm));
+	ta = calloc(count, sizeof(*ta));
+	m = mpd_newConnection(host, port, 60);
+
+	if (!tm || !ta || !m || m->error)
+	{
+		fprintf(stderr, "%s: %s\n", where, m ? m->errorStr : "out of memory");
+		if (m) mpd_closeConnection(m);
+		free(tm);
+		free(ta);
+		return -1;
+	}
+
+	if (password)
+	{
+		mpd_sendPasswordCommand(m, password);
+		mpd_finishCommand(m);
+	}
+
+	mpd_initArena(&arena, 0);
+
+	for (i = 0; i < count && !m->error; i++)
+	{
+		bench_cpu(&a);
+		n = bench_list_malloc(m, &songs, &size);
+		bench_cpu(&b);
+		tm[i] = bench_usec(&a, &b);
+
+		bench_cpu(&a);
+		n = bench_list_arena(m, &arena, &songs, &size);
+		bench_cpu(&b);
+		ta[i] = bench_usec(&a, &b);
+	}
+
+	if (!m->error)
+	{
+		printf("listing  %-30s %u songs, arena %lu KiB\n", where, n, (unsigned long)(arena.allocated / 1024));
+		bench_print("malloc", where, tm, count);
+		bench_print("arena", where, ta, count);
+	}
+
+	i = m->error;
+	if (i) fprintf(stderr, "%s: %s\n", where, m->errorStr);
+
+	mpd_finishArena(&arena);
+	mpd_closeConnection(m);
+	free(songs);
+	free(tm);
+	free(ta);
+
+	return i ? -1 : 0;
+}
@@ -17,24 +17,34 @@
 #define MPD_HOST_DEFAULT "localhost"
 #define MPD_PORT_DEFAULT "6600"
 
-struct empcd_events	events[100];
-unsigned int		maxevent = 0;
+struct empcd_device	*devices = NULL;
+struct empcd_keymap	*retiring = NULL, *retired = NULL;
+struct empcd_dedup	dedup;
+unsigned int		dedup_window = EMPCD_DEDUP_WINDOW;
+uint32_t		frameno = 0;
+char			*config = NULL;
 mpd_Connection		*mpd = NULL;
 unsigned int		verbosity = 0, drop_uid = 0, drop_gid = 0;
+struct empcd_loop	loop, exec_loop;
+struct empcd_queue	queue;
+mpd_Connection		*mpd_idle = NULL;
+struct empcd_link	mpd_cmd, mpd_stat;
+struct empcd_status	mirror;
+mpd_Status		mpd_status;		/* Executor scratch, see empcd_status() */
+struct empcd_breaker	breaker;
+struct empcd_offline	offline;
+bool			mpd_lost = false;
 bool			daemonize = true;
 bool			running = true;
 bool			exclusive = true;
 bool			giveup = true;
 bool			nompd = false;
 char			*mpd_host = NULL, *mpd_port = NULL;
-
-/* When we receive a signal, we abort */
-static void handle_signal(int i);
-static void handle_signal(int i)
-{
-	running = false;
-	signal(i, &handle_signal);
-}
+struct empcd_failover	failover;
+struct empcd_group	*groups = NULL;
+struct empcd_children	children;
+struct empcd_coproc	*coprocs = NULL;
+unsigned int		exec_limit = EMPCD_EXEC_LIMIT;
 
 static void doelogA(int level, int errnum, const char *fmt, va_list ap) ATTR_FORMAT(printf, 3, 0);
 static void doelogA(int level, int errnum, const char *fmt, va_list ap)
@@ -42,6 +52,9 @@ static void doelogA(int level, int errnum, const char *fmt, va_list ap)
 	char		buf[8192];
 	int		k;
 	unsigned int	i;
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+	const char	*e;
+#endif
 
 	if (level == LOG_DEBUG && verbosity < 1) return;
 
@@ -65,7 +78,14 @@ static void doelogA(int level, int errnum, const char *fmt, va_list ap)
 			buf[i+1] = '\0';
 
 			errno = 0;
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+			/* The GNU one returns the description, not necessarily in buf */
+			e = strerror_r(errnum, &buf[i+1], sizeof(buf) - (i+2));
+			if (e != &buf[i+1]) snprintf(&buf[i+1], sizeof(buf) - (i+2), "%s", e);
+			k = 0;
+#else
 			k = strerror_r(errnum, &buf[i+1], sizeof(buf) - (i+2));
+#endif
 			if (k == 0)
 			{
 				i = strlen(buf);
@@ -123,849 +143,4726 @@ static void dolog(int level, const char *fmt, ...)
 	va_end(ap);
 }
 
-static mpd_Connection *empcd_setup(void);
-static mpd_Connection *empcd_setup(void)
+/********************************************************************/
+
+static bool loop_init(struct empcd_loop *l);
+static bool loop_init(struct empcd_loop *l)
 {
-	int		iport;
-	char		*test;
-	int		password_len = 0;
-	int		parsed_len = 0;
-	mpd_Connection	*m = NULL;
+	memset(l, 0, sizeof(*l));
 
-	if (nompd)
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->epfd < 0)
 	{
-		dolog(LOG_ERR, "MPD connection disabled\n");
-		return NULL;
+		doelog(LOG_ERR, errno, "Couldn't create epoll instance\n");
+		return false;
 	}
 
-	if (!mpd_host || !mpd_port)
+	clock_gettime(CLOCK_MONOTONIC, &l->started);
+	l->running = true;
+	return true;
+}
+
+static void loop_exit(struct empcd_loop *l);
+static void loop_exit(struct empcd_loop *l)
+{
+	if (l->epfd >= 0) close(l->epfd);
+	l->epfd = -1;
+}
+
+static bool loop_add(struct empcd_loop *l, struct empcd_watch *w, uint32_t events);
+static bool loop_add(struct empcd_loop *l, struct empcd_watch *w, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
 	{
-		dolog(LOG_ERR, "Either MPD_HOST or MPD_PORT not configured\n");
-		return NULL;
+		doelog(LOG_ERR, errno, "Couldn't add fd %d to the event loop\n", w->fd);
+		return false;
 	}
-	
-	iport = strtol(mpd_port, &test, 10);
-	if (iport <= 0 || test[0] != '\0')
+
+	return true;
+}
+
+static bool loop_mod(struct empcd_loop *l, struct empcd_watch *w, uint32_t events);
+static bool loop_mod(struct empcd_loop *l, struct empcd_watch *w, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+
+	if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, w->fd, &ev) < 0)
 	{
-		dolog(LOG_ERR, "MPD_PORT \"%s\" is not a positive integer\n", mpd_port);
-		return NULL;
+		doelog(LOG_ERR, errno, "Couldn't modify fd %d in the event loop\n", w->fd);
+		return false;
 	}
 
-	/* parse password and host */
-	test = strstr(mpd_host,"@");
-	password_len = test - mpd_host;
-	if (test) parsed_len++;
+	return true;
+}
 
-	if (!test) password_len = 0;
-	if (test && password_len != 0) parsed_len += password_len;
+static void loop_del(struct empcd_loop *l, struct empcd_watch *w);
+static void loop_del(struct empcd_loop *l, struct empcd_watch *w)
+{
+	int i;
 
-	m = mpd_newConnection(mpd_host + parsed_len, iport, 10);
-	if (!m) return NULL;
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, w->fd, NULL);
 
-	if (m->error)
+	/* Don't deliver events of this round to a watch that is gone */
+	for (i = 0; i < l->nevents; i++)
 	{
-		dolog(LOG_ERR, "MPD Connection Error: %s\n", m->errorStr);
-		return NULL;
+		if (l->events[i].data.ptr == w) l->events[i].data.ptr = NULL;
 	}
+}
+
+/* Wakeups per hour since the loop started, 0 idle wakeups is the goal */
+static uint64_t loop_wakeups_hour(struct empcd_loop *l);
+static uint64_t loop_wakeups_hour(struct empcd_loop *l)
+{
+	struct timespec	now;
+	uint64_t	secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - l->started.tv_sec;
+	if (secs == 0) secs = 1;
+
+	return __atomic_load_n(&l->wakeups, __ATOMIC_RELAXED) * 3600 / secs;
+}
+
+static void loop_stop(struct empcd_loop *l);
+static void loop_stop(struct empcd_loop *l)
+{
+	__atomic_store_n(&l->running, false, __ATOMIC_RELEASE);
+}
+
+static void loop_run(struct empcd_loop *l);
+static void loop_run(struct empcd_loop *l)
+{
+	struct empcd_watch	*w;
+	int			i;
 
-	if (password_len)
+	while (__atomic_load_n(&l->running, __ATOMIC_ACQUIRE))
 	{
-		char *pass = strdup(mpd_host);
-		pass[password_len] = '\0';
-		mpd_sendPasswordCommand(m, pass);
-		mpd_finishCommand(m);
-		free(pass);
+		/* No timeout, we only wake up when there is something to do */
+		l->nevents = epoll_wait(l->epfd, l->events, EMPCD_LOOP_EVENTS, -1);
+		if (l->nevents < 0)
+		{
+			l->nevents = 0;
+			if (errno == EINTR) continue;
+			doelog(LOG_ERR, errno, "epoll_wait failed\n");
+			break;
+		}
+
+		STAT_ADD(l->wakeups, 1);
 
-		if (m->error)
+		for (i = 0; i < l->nevents; i++)
 		{
-			dolog(LOG_ERR, "MPD Authentication Error: %s\n", m->errorStr);
-			return NULL;
+			w = (struct empcd_watch *)l->events[i].data.ptr;
+			if (w) w->handler(w, l->events[i].events);
 		}
-	}
 
-	return m;
+		l->nevents = 0;
+
+		if (l->flush) l->flush(l);
+	}
 }
 
-static bool mpd_check(void);
-static bool mpd_check(void)
+/********************************************************************/
+
+/* Split "[password@]host" and check the port, once at startup */
+static bool mpd_config(struct empcd_server *srv);
+static bool mpd_config(struct empcd_server *srv)
 {
-	if (nompd) return true;
+	char	*test;
+	long	iport;
 
-	if (!mpd->error) return false;
+	if (srv->password) free(srv->password);
+	srv->password = NULL;
 
-	/* Ignore timeouts */
-	if (mpd->error != MPD_ERROR_CONNCLOSED)
+	if (!srv->host || !srv->port)
 	{
-		dolog(LOG_WARNING, "MPD error: %s\n", mpd->errorStr);
+		dolog(LOG_ERR, "Either MPD_HOST or MPD_PORT not configured\n");
+		return false;
 	}
 
-	/* Don't reconnect for non-fatal errors */
-	if (mpd->error < 10 && mpd->error > 19)
+	iport = strtol(srv->port, &test, 10);
+	if (iport <= 0 || iport > 65535 || test[0] != '\0')
 	{
+		dolog(LOG_ERR, "MPD_PORT \"%s\" is not a positive integer\n", srv->port);
 		return false;
 	}
+	srv->iport = iport;
 
-	/* Close the old connection */
-	mpd_closeConnection(mpd);
+	/* parse password and host */
+	test = strchr(srv->host, '@');
+	if (test)
+	{
+		if (test != srv->host) srv->password = strndup(srv->host, test - srv->host);
+		srv->hostname = test + 1;
+	}
+	else srv->hostname = srv->host;
 
-	/* Setup a new connection */
-	mpd = empcd_setup();
-	if (!mpd)
+	/* A path is a local socket, no TCP stack involved */
+	if (srv->hostname[0] == '/')
 	{
-		dolog(LOG_ERR, "MPD Connection Lost, exiting\n");
-		exit(0);
+		if (strlen(srv->hostname) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+		{
+			dolog(LOG_ERR, "MPD socket path \"%s\" is too long\n", srv->hostname);
+			return false;
+		}
+
+		snprintf(srv->where, sizeof(srv->where), "%s", srv->hostname);
 	}
+	else snprintf(srv->where, sizeof(srv->where), "%s:%u", srv->hostname, srv->iport);
 
 	return true;
 }
 
-static mpd_Status *empcd_status(void);
-static mpd_Status *empcd_status(void)
+/*
+ * MPD links
+ * Connections to MPD are driven from the executor loop by a small state
+ * machine: resolve (cached), non-blocking connect, welcome, password and
+ * then ready. Failures are retried with an exponential backoff, thus
+ * neither startup nor the processing of input ever waits for MPD.
+ * The owner is told about every change in state through state().
+ */
+static void link_close(struct empcd_link *m);
+static void link_close(struct empcd_link *m)
 {
-	int retry = 5;
-	mpd_Status *s = NULL;
+	enum empcd_link_state was = m->state;
 
-	if (nompd) return NULL;
+	m->state = EMPCD_LINK_DOWN;
 
-	while (retry > 0)
-	{
-		retry--;
+	if (m->watch.fd >= 0) loop_del(&exec_loop, &m->watch);
 
-		mpd_sendStatusCommand(mpd);
-		if (mpd_check()) continue;
+	/* The connection owns the socket once there is one */
+	if (m->conn) mpd_closeConnection(m->conn);
+	else if (m->watch.fd >= 0) close(m->watch.fd);
 
-		s = mpd_getStatus(mpd);
-		if (mpd_check()) continue;
+	m->conn = NULL;
+	m->watch.fd = -1;
 
-		mpd_finishCommand(mpd);
-		if (mpd_check()) continue;
+	if (was == EMPCD_LINK_READY) m->state_changed(m);
+}
 
-		break;
-	}
+/* Fire the link timer in ms milliseconds, 0 disarms it */
+static void link_arm(struct empcd_link *m, unsigned int ms);
+static void link_arm(struct empcd_link *m, unsigned int ms)
+{
+	struct itimerspec its;
 
-	return s;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(m->timer.fd, 0, &its, NULL) < 0)
+	{
+		doelog(LOG_ERR, errno, "Couldn't arm the MPD %s timer\n", m->name);
+	}
 }
 
-/********************************************************************/
+static void link_backoff(struct empcd_link *m, const char *why);
+static void link_backoff(struct empcd_link *m, const char *why)
+{
+	/* Only the first failure in a row is worth a warning */
+	dolog(m->backoff == EMPCD_BACKOFF_MIN ? LOG_WARNING : LOG_DEBUG,
+		"MPD %s connection to %s: %s, retrying in %u ms\n", m->name, m->server->where, why, m->backoff);
 
-static void f_exec(const char *arg, const char *args);
-static void f_exec(const char *arg, const char *args)
+	link_close(m);
+	link_arm(m, m->backoff);
+
+	m->backoff *= 2;
+	if (m->backoff > EMPCD_BACKOFF_MAX) m->backoff = EMPCD_BACKOFF_MAX;
+
+	STAT_ADD(m->failures, 1);
+	m->state = EMPCD_LINK_BACKOFF;
+	m->state_changed(m);
+}
+
+static void link_ready(struct empcd_link *m);
+static void link_ready(struct empcd_link *m)
 {
-	if ((!arg || strlen(arg) == 0) && args)
+	dolog((m->connects == 0 || m->backoff > EMPCD_BACKOFF_MIN) ? LOG_INFO : LOG_DEBUG,
+		"MPD %s connection to %s ready, MPD %u.%u.%u\n", m->name, m->server->where,
+		m->conn->version[0], m->conn->version[1], m->conn->version[2]);
+
+	m->backoff = EMPCD_BACKOFF_MIN;
+	STAT_ADD(m->connects, 1);
+	link_arm(m, 0);
+
+	/* MPD only talks when asked, readable now means news or a hangup */
+	m->state = EMPCD_LINK_READY;
+	if (!loop_mod(&exec_loop, &m->watch, EPOLLIN | EPOLLRDHUP))
 	{
-		dolog(LOG_WARNING, "f_exec requires '%s' as an argument, none given, ignoring\n", args);
+		link_backoff(m, "event loop failure");
 		return;
 	}
 
-	if (system(arg) < 0)
-	{
-		doelog(LOG_WARNING, errno, "f_exec failed to execute '%s'\n", arg);
-	}
+	m->state_changed(m);
 }
 
-static void f_quit(const char UNUSED *arg, const char UNUSED *args);
-static void f_quit(const char UNUSED *arg, const char UNUSED *args)
+/* Try the current address and on failure the ones after it */
+static void link_try(struct empcd_link *m);
+static void link_try(struct empcd_link *m)
 {
-	running = false;
-}
+	int fd;
 
-#define QUOTE(s) #s
-#define STR(s) QUOTE(s)
-#define F_CMDG(fn, f)											\
-static void f_##fn(const char *arg, const char *args);							\
-static void f_##fn(const char *arg, const char *args)							\
-{													\
-	int retries;											\
-													\
-	if (nompd)											\
-	{												\
-		dolog(LOG_INFO, "%s not executing as MPD is disabled (nompd)\n", STR(fn));		\
-		return;											\
-	}												\
-													\
-	if ((!arg || strlen(arg) == 0) && args)								\
-	{												\
-		dolog(LOG_WARNING, "%s requires '%s' as an argument, none given, ignoring\n", #fn, args); \
-		return;											\
-	}												\
-													\
-	for (retries = 5; retries > 0; retries--)							\
-	{												\
-		f;											\
-		if (mpd_check()) continue;								\
-		mpd_finishCommand(mpd);									\
-		if (mpd_check()) continue;								\
-		break;											\
-	}												\
-}
+	for (; m->ai; m->ai = m->ai->ai_next)
+	{
+		fd = socket(m->ai->ai_family, m->ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, m->ai->ai_protocol);
+		if (fd < 0) continue;
 
-/* G = Given argument, N = No Argument, A = 'arg' as argument */
-#define F_CMDN(fn, f)	F_CMDG(fn,f(mpd))
-#define F_CMDA(fn, f)	F_CMDG(fn,f(mpd, arg))
+		if (connect(fd, m->ai->ai_addr, m->ai->ai_addrlen) < 0 && errno != EINPROGRESS)
+		{
+			doelog(LOG_DEBUG, errno, "MPD %s connection: connect failed\n", m->name);
+			close(fd);
+			continue;
+		}
 
-F_CMDN(next,	mpd_sendNextCommand)
-F_CMDN(prev,	mpd_sendPrevCommand)
-F_CMDN(stop,	mpd_sendStopCommand)
-F_CMDG(play,	mpd_sendPlayCommand(mpd,-1))
-F_CMDA(save,	mpd_sendSaveCommand)
-F_CMDA(load,	mpd_sendLoadCommand)
-F_CMDA(remove,	mpd_sendRmCommand)
-F_CMDN(clear,	mpd_sendClearCommand)
+		/* Writable once connected, also when done right away */
+		m->watch.fd = fd;
+		m->state = EMPCD_LINK_CONNECTING;
+		if (!loop_add(&exec_loop, &m->watch, EPOLLOUT))
+		{
+			link_backoff(m, "event loop failure");
+		}
+		return;
+	}
 
-static void f_volume(const char *arg, const char UNUSED *args);
-static void f_volume(const char *arg, const char UNUSED *args)
-{
-	int	dir = 0, volume = 0, i = 0, retry = 5;
-	bool	perc = false;
-	mpd_Status *status;
+	/* Tried them all, resolve again the next round, the address might have changed */
+	if (m->addrs != &m->local) freeaddrinfo(m->addrs);
+	m->addrs = NULL;
 
-	status = empcd_status();
-	if (!status) return;
+	link_backoff(m, "couldn't connect");
+}
 
-	if (arg[0] == '-')	{ i++; dir = -1; }
-	else if (arg[0] == '+') { i++; dir = +1; }
-	volume = strlen(&arg[i]);
-	if (arg[i+volume] == '%') perc = true;
+/* Connect, when not connected or connecting already */
+static void link_start(struct empcd_link *m);
+static void link_start(struct empcd_link *m)
+{
+	struct addrinfo	hints;
+	char		why[256];
+	int		err;
 
-	volume = atoi(&arg[i]);
+	if (m->state != EMPCD_LINK_DOWN && m->state != EMPCD_LINK_BACKOFF) return;
 
-	if (perc)
+	if (!m->addrs && m->server->hostname[0] == '/')
 	{
-		if (dir != 0) volume = status->volume + ((status->volume * volume / 100) * dir);
-		else volume = (status->volume * perc / 100);
+		memset(&m->local, 0, sizeof(m->local));
+		memset(&m->local_addr, 0, sizeof(m->local_addr));
+		m->local_addr.sun_family = AF_UNIX;
+		strcpy(m->local_addr.sun_path, m->server->hostname);
+
+		m->local.ai_family = AF_UNIX;
+		m->local.ai_socktype = SOCK_STREAM;
+		m->local.ai_addr = (struct sockaddr *)&m->local_addr;
+		m->local.ai_addrlen = sizeof(m->local_addr);
+		m->addrs = &m->local;
 	}
-	else
+	else if (!m->addrs)
 	{
-		if (dir != 0) volume = status->volume + (volume*dir);
-		/* dir == 0 case is set correctly above, as no adjustment is needed */
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		err = getaddrinfo(m->server->hostname, m->server->port, &hints, &m->addrs);
+		if (err != 0)
+		{
+			m->addrs = NULL;
+			snprintf(why, sizeof(why), "couldn't resolve %s: %s", m->server->hostname, gai_strerror(err));
+			link_backoff(m, why);
+			return;
+		}
 	}
 
-	/* Take care of limits */
-	if (volume < 0 || volume > 100) return;
+	/* Connecting, the welcome and the password all have to fit in this */
+	link_arm(m, EMPCD_DEADLINE_CONNECT);
+
+	m->ai = m->addrs;
+	link_try(m);
+}
+
+static void link_event(struct empcd_watch *w, uint32_t events);
+static void link_event(struct empcd_watch *w, uint32_t events)
+{
+	struct empcd_link	*m = (struct empcd_link *)w->data;
+	char			why[MPD_ERRORSTR_MAX_LENGTH + 32];
+	socklen_t		len = sizeof(int);
+	int			err = 0;
 
-	while (retry > 0)
+	switch (m->state)
 	{
-		retry--;
-		mpd_sendSetvolCommand(mpd, volume);
-		if (mpd_check()) continue;
-		mpd_finishCommand(mpd);
-		if (mpd_check()) continue;
+	case EMPCD_LINK_CONNECTING:
+		if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+		if (err != 0)
+		{
+			dolog(LOG_DEBUG, "MPD %s connection: connect failed: %s\n", m->name, strerror(err));
+			loop_del(&exec_loop, w);
+			close(w->fd);
+			w->fd = -1;
+
+			m->ai = m->ai->ai_next;
+			link_try(m);
+			return;
+		}
+
+		m->conn = mpd_newConnectionSocket(w->fd, EMPCD_MPD_TIMEOUT);
+		if (!m->conn || m->conn->error)
+		{
+			link_backoff(m, m->conn ? m->conn->errorStr : "out of memory");
+			break;
+		}
+
+		m->state = EMPCD_LINK_WELCOME;
+		if (!loop_mod(&exec_loop, w, EPOLLIN | EPOLLRDHUP)) link_backoff(m, "event loop failure");
 		break;
-	}
 
-	mpd_freeStatus(status);
-}
+	case EMPCD_LINK_WELCOME:
+		err = mpd_readWelcome(m->conn, m->server->hostname, m->server->iport);
+		if (err == 0) break;
 
-static void f_seek(const char *arg, const char UNUSED *args);
-static void f_seek(const char *arg, const char UNUSED *args)
-{
-	int	dir = 0, seekto = 0, i = 0, retry = 5;
-	bool	perc = false;
+		if (err < 0)
+		{
+			link_backoff(m, m->conn->errorStr);
+			break;
+		}
 
-	mpd_Status *status = empcd_status();
-	if (!status) return;
+		if (!m->server->password)
+		{
+			link_ready(m);
+			break;
+		}
 
-	if (arg[0] == '-')	{ i++; dir = -1; }
-	else if (arg[0] == '+') { i++; dir = +1; }
-	seekto = strlen(&arg[i]);
-	if (arg[i+seekto] == '%') perc = true;
+		/* (Re-)authenticate, the answer wakes us up again */
+		mpd_sendPasswordCommand(m->conn, m->server->password);
+		if (m->conn->error) link_backoff(m, m->conn->errorStr);
+		else m->state = EMPCD_LINK_AUTH;
+		break;
 
-	seekto = atoi(&arg[i]);
+	case EMPCD_LINK_AUTH:
+		mpd_finishCommand(m->conn);
+		if (m->conn->error)
+		{
+			snprintf(why, sizeof(why), "authentication failed: %s", m->conn->errorStr);
+			link_backoff(m, why);
+			break;
+		}
 
-	if (perc)
-	{
-		if (dir != 0) seekto = status->elapsedTime + ((status->totalTime * seekto / 100) * dir);
-		else seekto = (status->totalTime * perc / 100);
-	}
-	else
-	{
-		if (dir != 0) seekto = status->elapsedTime + (seekto*dir);
-		/* dir == 0 case is set correctly above */
-	}
+		link_ready(m);
+		break;
 
-	/*
-	 * Take care of limits
-	 * (end-10 so that one can search till the end easily)
-	 */
-	if (seekto < 0 || seekto > (status->totalTime-10)) return;
+	case EMPCD_LINK_READY:
+		m->readable(m, events);
+		break;
 
-	while (retry > 0)
-	{
-		retry--;
-		mpd_sendSeekIdCommand(mpd, status->songid, seekto);
-		if (mpd_check()) continue;
-		mpd_finishCommand(mpd);
-		if (mpd_check()) continue;
+	default:
 		break;
 	}
-
-	mpd_freeStatus(status);
 }
 
-static void f_pause(const char *arg, const char UNUSED *args);
-static void f_pause(const char *arg, const char UNUSED *args)
+static void link_timer(struct empcd_watch *w, uint32_t events);
+static void link_timer(struct empcd_watch *w, uint32_t UNUSED events)
 {
-	int retry = 5, mode = 0;
-	if (!arg || strlen(arg) == 0 || (strcasecmp(arg, "toggle") == 0))
-	{
-		/* Toggle the pause mode */
-		mpd_Status *status = empcd_status();
-		if (!status) return;
+	struct empcd_link	*m = (struct empcd_link *)w->data;
+	uint64_t		expirations;
 
-		mode = (status->state == MPD_STATUS_STATE_PAUSE ? 0 : 1);
-		mpd_freeStatus(status);
-	}
-	else if (strcasecmp(arg, "on" ) == 0) mode = 1;
-	else if (strcasecmp(arg, "off") == 0) mode = 0;
+	if (read(w->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
 
-	while (retry > 0)
+	switch (m->state)
 	{
-		retry--;
-		mpd_sendPauseCommand(mpd, mode);
-		if (mpd_check()) continue;
-		mpd_finishCommand(mpd);
-		if (mpd_check()) continue;
+	case EMPCD_LINK_CONNECTING:
+	case EMPCD_LINK_WELCOME:
+	case EMPCD_LINK_AUTH:
+		/* Connect deadline, MPD (or something pretending to be it) hangs */
+		link_backoff(m, "timed out while connecting");
+		break;
+
+	case EMPCD_LINK_DOWN:
+	case EMPCD_LINK_BACKOFF:
+		link_start(m);
+		break;
+
+	default:
 		break;
 	}
 }
 
-static void f_random(const char *arg, const char UNUSED *args);
-static void f_random(const char *arg, const char UNUSED *args)
+static bool link_init(struct empcd_link *m, const char *name, struct empcd_server *server, void (*state_changed)(struct empcd_link *m), void (*readable)(struct empcd_link *m, uint32_t events));
+static bool link_init(struct empcd_link *m, const char *name, struct empcd_server *server, void (*state_changed)(struct empcd_link *m), void (*readable)(struct empcd_link *m, uint32_t events))
 {
-	int retry = 5, mode = 0;
+	memset(m, 0, sizeof(*m));
 
-	if (!arg || strlen(arg) == 0 || (strcasecmp(arg, "toggle") == 0))
-	{
-		/* Toggle the random mode */
-		mpd_Status *status = empcd_status();
-		if (!status) return;
+	m->name = name;
+	m->server = server;
+	m->state = EMPCD_LINK_DOWN;
+	m->backoff = EMPCD_BACKOFF_MIN;
+	m->state_changed = state_changed;
+	m->readable = readable;
 
-		mode = !status->random;
-		mpd_freeStatus(status);
-	}
-	else if (strcasecmp(arg, "on" ) == 0) mode = 1;
-	else if (strcasecmp(arg, "off") == 0) mode = 0;
+	m->watch.fd = -1;
+	m->watch.handler = link_event;
+	m->watch.data = m;
 
-	while (retry > 0)
+	m->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m->timer.fd < 0)
 	{
-		retry--;
-		mpd_sendRandomCommand(mpd, mode);
-		if (mpd_check()) continue;
-		mpd_finishCommand(mpd);
-		if (mpd_check()) continue;
-		break;
+		doelog(LOG_ERR, errno, "Couldn't create the MPD %s timer\n", name);
+		return false;
 	}
+
+	m->timer.handler = link_timer;
+	m->timer.data = m;
+
+	return loop_add(&exec_loop, &m->timer, EPOLLIN);
 }
 
-static void f_update(const char *arg, const char UNUSED *args);
-static void f_update(const char *arg, const char UNUSED *args)
+static void link_exit(struct empcd_link *m);
+static void link_exit(struct empcd_link *m)
 {
-	char	*path;
-	int	retry = 5;
-
-	path = (char *)(arg == NULL ? "" : arg);
+	link_close(m);
 
-	while (retry > 0)
+	if (m->timer.fd >= 0)
 	{
-		retry--;
-		mpd_sendUpdateCommand(mpd, path);
-		if (mpd_check()) continue;
-		mpd_finishCommand(mpd);
-		if (mpd_check()) continue;
-		break;
+		loop_del(&exec_loop, &m->timer);
+		close(m->timer.fd);
+		m->timer.fd = -1;
 	}
+
+	if (m->addrs && m->addrs != &m->local) freeaddrinfo(m->addrs);
+	m->addrs = NULL;
 }
 
-static const struct empcd_funcs
-{
-	void		(*function)(const char *arg, const char *args);
-	bool		requires_mpd;
-	const char	*name;
-	const char	*args;
-	const char	*desc;
-} func_map[] =
-{
-	/* empcd builtin commands */
-	{ f_exec,	false, "exec",			"<shellcmd>",		"Execute a command"							},
-	{ f_quit,	false, "quit",			NULL,			"Quit empcd"								},
+/********************************************************************/
 
-	/* MPD specific commands */
-	{ f_next,	true, "mpd_next",		NULL,			"MPD Next Track"							},
-	{ f_prev,	true, "mpd_prev",		NULL,			"MPD Previous Track"							},
-	{ f_stop,	true, "mpd_stop",		NULL,			"MPD Stop Playing"							},
-	{ f_play,	true, "mpd_play",		NULL,			"MPD Start Playing"							},
-	{ f_pause,	true, "mpd_pause",		"[toggle|on|off]",	"MPD Pause Toggle or Set"						},
-	{ f_seek,	true, "mpd_seek",		"[+|-]<val>[%]",	"MPD Seek direct or relative (+|-) percentage when ends in %"		},
-	{ f_volume,	true, "mpd_volume",		"[+|-]<val>[%]",	"MPD Volume direct or relative (+|-) percentage when ends in %"		},
-	{ f_random,	true, "mpd_random",		"[toggle|on|off]",	"MPD Random Toggle or Set"						},
-	{ f_update,	true, "mpd_update",		"[<path>]",		"MPD Update"								},
-	{ f_load,	true, "mpd_plst_load",		"<playlist>",		"MPD Load Playlist"							},
-	{ f_save,	true, "mpd_plst_save",		"<playlist>",		"MPD Save Playlist"							},
-	{ f_clear,	true, "mpd_plst_clear",		NULL,			"MPD Clear Playlist"							},
-	{ f_remove,	true, "mpd_plst_remove",	"<playlist>",		"MPD Remove Playlist"							},
+/*
+ * MPD never talks to us unless asked to, thus the command connection
+ * becoming readable means that MPD closed it. A parked connection is
+ * exempt from connection_timeout, thus MPD went away: reconnect.
+ * Older servers close it for being idle too long; don't reconnect right
+ * away as that just causes another timeout, instead reconnect when the
+ * next action arrives.
+ */
+static void mpd_hangup(struct empcd_link *m, uint32_t events);
+static void mpd_hangup(struct empcd_link *m, uint32_t UNUSED events)
+{
+	if (m->conn->idle)
+	{
+		link_backoff(m, "connection closed by MPD");
+		return;
+	}
 
-	/* End */
-	{ NULL,		false, NULL,			NULL,			"undefined"								}
-};
+	dolog(LOG_DEBUG, "MPD closed the idle connection\n");
+	link_close(m);
+}
 
 /********************************************************************/
 
-static bool set_event(uint16_t type, uint16_t code, int32_t value, void (*action)(const char *arg, const char *args), const char *args, const char *needargs);
-static bool set_event(uint16_t type, uint16_t code, int32_t value, void (*action)(const char *arg, const char *args), const char *args, const char *needargs)
+static const char *breaker_name(enum empcd_breaker_state state);
+static const char *breaker_name(enum empcd_breaker_state state)
 {
-	if (maxevent >= (sizeof(events)/sizeof(events[0])))
+	switch (state)
 	{
-		dolog(LOG_ERR, "Maximum number of events reached\n");
-		return false;
+	case EMPCD_BREAKER_CLOSED:	return "closed";
+	case EMPCD_BREAKER_OPEN:	return "open";
+	case EMPCD_BREAKER_HALFOPEN:	return "half-open";
+	default:			return "unknown";
 	}
+}
 
-	/* Handle no-repeating 'up' key */
-	if (type == EV_KEY && value == EMPCD_KEY_UPNR)
+static void breaker_open(void);
+static void breaker_open(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &breaker.until);
+	breaker.until.tv_sec += breaker.cooldown / 1000;
+	breaker.until.tv_nsec += (breaker.cooldown % 1000) * 1000000;
+	if (breaker.until.tv_nsec >= 1000000000)
 	{
-		value = EV_KEY_UP;
-		events[maxevent].norepeat = true;
+		breaker.until.tv_sec++;
+		breaker.until.tv_nsec -= 1000000000;
 	}
 
-	events[maxevent].type = type;
-	events[maxevent].code = code;
-	events[maxevent].value = value;
-	events[maxevent].prev_value = -1; 
-	events[maxevent].action = action;
-	events[maxevent].args = args ? strdup(args) : args;
-	events[maxevent].needargs = needargs;
+	dolog(LOG_WARNING, "MPD circuit breaker open after %u failures, failing MPD actions for %u ms\n",
+		breaker.failures, breaker.cooldown);
 
-	maxevent++;
-	return true;
+	__atomic_store_n(&breaker.state, EMPCD_BREAKER_OPEN, __ATOMIC_RELAXED);
+	STAT_ADD(breaker.trips, 1);
+
+	/* Each failed probe doubles the cooldown */
+	breaker.cooldown *= 2;
+	if (breaker.cooldown > EMPCD_BREAKER_COOLDOWN_MAX) breaker.cooldown = EMPCD_BREAKER_COOLDOWN_MAX;
 }
 
-static bool which_func(const char *buf, unsigned int len, unsigned int *o_, unsigned int *func_, const char **arg);
-static bool which_func(const char *buf, unsigned int len, unsigned int *o_, unsigned int *func_, const char **arg)
+/*
+ * A command timed out or broke the connection. Not being able to connect
+ * is left to the link backoff, MPD restarting should not trip the breaker.
+ */
+static void breaker_failure(void);
+static void breaker_failure(void)
 {
-	unsigned int i, o = *o_, l;
+	breaker.failures++;
 
-	/* Figure out the function */
-	for (i=0; func_map[i].name != NULL; i++)
+	switch (breaker.state)
 	{
-		l = strlen(func_map[i].name);
-		if (len != o+l && (len < o+l || buf[o+l] != ' ')) continue;
-		if (strncasecmp(&buf[o], func_map[i].name, l) == 0) break;
+	case EMPCD_BREAKER_CLOSED:
+		if (breaker.failures >= EMPCD_BREAKER_FAILURES) breaker_open();
+		break;
+
+	case EMPCD_BREAKER_HALFOPEN:
+		breaker_open();
+		break;
+
+	default:
+		break;
 	}
+}
 
-	if (func_map[i].name == NULL)
+/* MPD answered a command completely, even an ACK means it is alive */
+static void breaker_success(void);
+static void breaker_success(void)
+{
+	if (breaker.state == EMPCD_BREAKER_HALFOPEN)
 	{
-		*o_ = o;
-		return false;
+		dolog(LOG_INFO, "MPD circuit breaker closed, MPD is healthy again\n");
+		__atomic_store_n(&breaker.state, EMPCD_BREAKER_CLOSED, __ATOMIC_RELAXED);
 	}
-	*func_ = i;
 
-	o += l+1;
-	if (len > o) *arg = &buf[o];
-	else *arg = NULL;
+	if (breaker.state == EMPCD_BREAKER_CLOSED)
+	{
+		breaker.failures = 0;
+		breaker.cooldown = EMPCD_BREAKER_COOLDOWN;
+	}
+}
 
-	*o_ = o;
+/* May an MPD action be tried? Moves to half-open once the cooldown passed */
+static bool breaker_allow(void);
+static bool breaker_allow(void)
+{
+	struct timespec now;
+
+	if (breaker.state != EMPCD_BREAKER_OPEN) return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (	now.tv_sec < breaker.until.tv_sec ||
+		(now.tv_sec == breaker.until.tv_sec && now.tv_nsec < breaker.until.tv_nsec))
+	{
+		STAT_ADD(breaker.rejected, 1);
+		return false;
+	}
 
+	dolog(LOG_INFO, "MPD circuit breaker half-open, trying MPD again\n");
+	__atomic_store_n(&breaker.state, EMPCD_BREAKER_HALFOPEN, __ATOMIC_RELAXED);
 	return true;
 }
 
+/********************************************************************/
+
 /*
-	KEY_KPSLASH DOWN f_seek -1
-	<key> <value> <action> <arg>
-*/
-static bool set_event_from_map(const char *buf, struct empcd_mapping *event_map, struct empcd_mapping *value_map);
-static bool set_event_from_map(const char *buf, struct empcd_mapping *event_map, struct empcd_mapping *value_map)
+ * Returns true when the connection is gone (the command failed),
+ * the link then reconnects by itself and mpd_lost is set.
+ */
+static bool mpd_check(void);
+static bool mpd_check(void)
 {
-	unsigned int	i = 0, o = 0, len = strlen(buf), l = 0,
-			event_code = 0,
-			value = 0, func = 0;
-	const char	*arg = NULL;
-	const char	*event_name = "custom", *event_desc = "custom";
+	if (!mpd) return true;
 
-	/* Not a numeric value? */
-	if (sscanf(&buf[o], "%u", &i) == 1 && i == 0)
+	if (!mpd->error) return false;
+
+	/* MPD refused the command, the connection is fine */
+	if (mpd->error == MPD_ERROR_ACK)
 	{
-		/* This is our event_code */
-		event_code = i;
+		dolog(LOG_WARNING, "MPD error: %s\n", mpd->errorStr);
+		return false;
 	}
-	else
+
+	/* Anything else, a passed deadline included, leaves the connection in an unknown state, start over */
+	mpd_lost = true;
+	breaker_failure();
+	link_backoff(&mpd_cmd, mpd->errorStr);
+	return true;
+}
+
+/*
+ * The command connection gets parked in 'idle message' between actions.
+ * MPD does not apply connection_timeout to idling clients, thus the
+ * connection stays warm, and as we never subscribe to a channel
+ * the idle never returns. Unparking is pipelined with the next command.
+ */
+#define MPD_CAN_IDLE(m)		((m)->version[0] > 0 || (m)->version[1] >= 14)
+#define MPD_CAN_PARK(m)		((m)->version[0] > 0 || (m)->version[1] >= 17)
+
+static void mpd_park(mpd_Connection *conn);
+static void mpd_park(mpd_Connection *conn)
+{
+	if (!conn) return;
+
+	/* Nothing outstanding that has a deadline */
+	mpd_setDeadline(conn, 0);
+
+	if (conn->idle || !MPD_CAN_PARK(conn)) return;
+
+	mpd_sendIdleCommand(conn, "message");
+	if (conn->error) mpd_clearError(conn);
+}
+
+/* Start a command that has to be answered within ms milliseconds, unparks when needed */
+static void mpd_begin(unsigned int ms);
+static void mpd_begin(unsigned int ms)
+{
+	mpd_setDeadline(mpd, ms);
+	if (mpd->idle) mpd_sendNoIdleCommand(mpd);
+}
+
+/* Send a command and wait for the result within ms, a no-op while disconnected */
+#define MPD_CMDD(ms, f)											\
+	do {												\
+		if (!mpd) break;									\
+		mpd_begin(ms);										\
+		f;											\
+		if (mpd_check()) break;									\
+		mpd_finishCommand(mpd);									\
+		if (!mpd_check()) breaker_success();							\
+	} while (0)
+
+#define MPD_CMD(f)	MPD_CMDD(EMPCD_DEADLINE_CMD, f)
+
+/* Did the last command succeed? */
+#define MPD_OK()	(mpd && !mpd->error)
+
+/* Does the command connection know a newer command (enum empcd_caps) */
+#define MPD_HAS(cap)	(mpd && (mpd_cmd.caps & (cap)))
+
+/* Fetch the status into s, which is reused to keep this off the heap */
+static bool empcd_status(mpd_Status *s);
+static bool empcd_status(mpd_Status *s)
+{
+	int ret;
+
+	if (!mpd) return false;
+
+	mpd_begin(EMPCD_DEADLINE_CMD);
+	mpd_sendStatusCommand(mpd);
+	if (mpd_check()) return false;
+
+	ret = mpd_fillStatus(mpd, s);
+	if (mpd_check()) return false;
+
+	mpd_finishCommand(mpd);
+	if (mpd_check()) return false;
+
+	breaker_success();
+	return ret == 0;
+}
+
+/* Which of the commands that save a round-trip does this server know */
+#define MPD_CAN_COMMANDS(m)	((m)->version[0] > 0 || (m)->version[1] >= 12)
+
+static const struct
+{
+	const char	*name;
+	unsigned int	cap;
+} mpd_capnames[] =
+{
+	{ "seekcur",	EMPCD_CAP_SEEKCUR },
+	{ "volume",	EMPCD_CAP_VOLUME },
+};
+
+static unsigned int mpd_caps(void);
+static unsigned int mpd_caps(void)
+{
+	unsigned int	caps = 0, i;
+	char		*cmd;
+
+	if (!mpd || !MPD_CAN_COMMANDS(mpd)) return 0;
+
+	mpd_begin(EMPCD_DEADLINE_CMD);
+	mpd_sendCommandsCommand(mpd);
+	if (mpd_check()) return 0;
+
+	while ((cmd = mpd_getNextCommand(mpd)) != NULL)
 	{
-		/* Try a name match */
-		for (i=0; event_map[i].code != EMPCD_MAPPING_END; i++)
+		for (i = 0; i < (sizeof(mpd_capnames)/sizeof(mpd_capnames[0])); i++)
 		{
-			l = strlen(event_map[i].name);
-			if (len < o+l || buf[o+l] != ' ') continue;
-			if (strncasecmp(&buf[o], event_map[i].name, l) == 0) break;
+			if (strcmp(cmd, mpd_capnames[i].name) == 0) caps |= mpd_capnames[i].cap;
 		}
+		free(cmd);
+	}
 
-		if (event_map[i].code == EMPCD_MAPPING_END)
-		{
-			dolog(LOG_DEBUG, "Undefined Code at %u in '%s'\n", o, buf);
-			return false;
-		}
+	if (mpd_check()) return 0;
+	mpd_finishCommand(mpd);
+	if (mpd_check()) return 0;
 
-		/* This is our event_code */
-		event_code = event_map[i].code;
-		event_name = event_map[i].name;
-		event_desc = event_map[i].desc;
+	return caps;
+}
+
+/********************************************************************/
+
+/*
+ * Status mirror
+ * A second connection sits in 'idle' and refreshes the mirror whenever
+ * MPD reports a change, so toggles and relative adjustments can be
+ * computed locally and need only one round-trip.
+ */
+static void status_from(struct empcd_status *st, const mpd_Status *s);
+static void status_from(struct empcd_status *st, const mpd_Status *s)
+{
+	st->state	= s->state;
+	st->volume	= s->volume;
+	st->random	= s->random;
+	st->repeat	= s->repeat;
+	st->consume	= s->consume;
+	st->single	= s->single;
+	st->song	= s->song;
+	st->songid	= s->songid;
+	st->length	= s->playlistLength;
+	st->elapsed	= s->elapsedMs;
+	st->total	= s->totalTime;
+	clock_gettime(CLOCK_MONOTONIC, &st->at);
+}
+
+/* Fetch the status on the idle connection and go back to idling */
+static bool mirror_refresh(void);
+static bool mirror_refresh(void)
+{
+	mpd_setDeadline(mpd_idle, EMPCD_DEADLINE_CMD);
+	mpd_sendStatusCommand(mpd_idle);
+	if (mpd_fillStatus(mpd_idle, &mpd_status) < 0) return false;
+
+	mpd_finishCommand(mpd_idle);
+	if (mpd_idle->error) return false;
+
+	status_from(&mirror, &mpd_status);
+
+	/* Idling has no deadline */
+	mpd_setDeadline(mpd_idle, 0);
+	mpd_sendIdleCommand(mpd_idle, "player mixer options playlist");
+	if (mpd_idle->error) return false;
+
+	mirror.valid = true;
+	STAT_ADD(mirror.refreshes, 1);
+	return true;
+}
+
+static void mirror_changed(struct empcd_link *m, uint32_t events);
+static void mirror_changed(struct empcd_link *m, uint32_t UNUSED events)
+{
+	const char *changed;
+
+	while ((changed = mpd_getNextChangedValue(mpd_idle)) != NULL)
+	{
+		dolog(LOG_DEBUG, "MPD changed: %s\n", changed);
 	}
 
-	/* Figure out the value (up/down/release/...) */
-	o += l+1;
-	for (i=0; value_map[i].code != EMPCD_MAPPING_END; i++)
+	if (mpd_idle->error || !mirror_refresh()) link_backoff(m, mpd_idle->errorStr);
+}
+
+static void mirror_state(struct empcd_link *m);
+static void mirror_state(struct empcd_link *m)
+{
+	if (m->state != EMPCD_LINK_READY)
 	{
-		l = strlen(value_map[i].name);
-		if (len < o+l || buf[o+l] != ' ') continue;
-		if (strncasecmp(&buf[o], value_map[i].name, l) == 0) break;
+		mpd_idle = NULL;
+		mirror.valid = false;
+		return;
 	}
 
-	if (value_map[i].code == EMPCD_MAPPING_END)
+	mpd_idle = m->conn;
+	if (!mirror_refresh()) link_backoff(m, mpd_idle->errorStr);
+}
+
+/* The current status, from the mirror when possible */
+static bool status_get(struct empcd_status *st);
+static bool status_get(struct empcd_status *st)
+{
+	struct timespec	now;
+
+	if (mirror.valid)
 	{
-		dolog(LOG_DEBUG, "Undefined Key Value at %u in '%s'\n", o, buf);
-		return false;
+		*st = mirror;
+		STAT_ADD(mirror.hits, 1);
+
+		/* Estimate how far the song progressed since */
+		if (st->state == MPD_STATUS_STATE_PLAY)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			st->elapsed += (now.tv_sec - st->at.tv_sec) * 1000 + (now.tv_nsec - st->at.tv_nsec) / 1000000;
+			if (st->elapsed > st->total * 1000) st->elapsed = st->total * 1000;
+		}
+
+		return true;
 	}
-	value = i;
 
-	o += l+1;
+	STAT_ADD(mirror.misses, 1);
 
-	/* Figure out the function */
-	if (!which_func(buf, len, &o, &i, &arg))
+	if (!empcd_status(&mpd_status)) return false;
+
+	status_from(st, &mpd_status);
+	return true;
+}
+
+/********************************************************************/
+
+/* Fill in a server from "[password@]host[:port]" (modified), without a port mpd_port is used */
+static bool server_parse(struct empcd_server *srv, char *host);
+static bool server_parse(struct empcd_server *srv, char *host)
+{
+	char *name, *port;
+
+	/* A port follows a single ':', not for socket paths or IPv6 addresses */
+	name = strchr(host, '@');
+	name = name ? name + 1 : host;
+	port = strchr(name, ':');
+	if (name[0] == '/' || (port && strchr(port + 1, ':'))) port = NULL;
+
+	if (port)
 	{
-		dolog(LOG_DEBUG, "Undefined Function at %u in '%s'\n", o, buf);
+		*port = '\0';
+		srv->port = strdup(port + 1);
+	}
+
+	srv->host = strdup(host);
+	if (!srv->host || (port && !srv->port))
+	{
+		dolog(LOG_ERR, "Out of memory while adding MPD server %s\n", host);
 		return false;
 	}
-	func = i;
 
-	dolog(LOG_DEBUG, "Mapping Event %s (%s/%u) %s (%s) to do %s (%s) with arg %s\n",
-		event_name, event_desc, event_code,
-		value_map[value].name, value_map[value].desc,
-		func_map[func].name, func_map[func].desc,
-		arg ? arg : "<none>");
+	return true;
+}
 
-	if (func_map[func].requires_mpd && nompd)
+/*
+ * MPD groups
+ * Every member has its own command link, kept parked like the main one.
+ * There is no status mirror, breaker or offline queue for members,
+ * only actions that don't need the status can go to a group.
+ */
+static struct empcd_group *group_find(const char *name, unsigned int len);
+static struct empcd_group *group_find(const char *name, unsigned int len)
+{
+	struct empcd_group *g;
+
+	for (g = groups; g; g = g->next)
 	{
-		dolog(LOG_ERR, "Function requires MPD but MPD is disabled\n");
-		return false;
+		if (strlen(g->name) == len && strncasecmp(g->name, name, len) == 0) break;
 	}
 
-	return set_event(EV_KEY, event_code, value_map[value].code, func_map[func].function, arg, func_map[func].args);
+	return g;
 }
 
-static bool set_event_from_custom(char *buf);
-static bool set_event_from_custom(char *buf)
+/* mpd_group <name> <[password@]host[:port]|socket> [...] */
+static bool group_add(char *buf);
+static bool group_add(char *buf)
 {
-	unsigned int	type, code, value;
-	unsigned int	o, c = 0, func;
-	const char	*arg;
+	struct empcd_group	*g, **gp;
+	struct empcd_member	*members;
+	char			*name, *host, *save = NULL;
 
-	dolog(LOG_ERR, "Custom Event: '%s'\n", buf);
+	name = strtok_r(buf, " ", &save);
+	if (!name)
+	{
+		dolog(LOG_ERR, "mpd_group requires a name and one or more hosts\n");
+		return false;
+	}
 
-	if (sscanf(buf, "%u %u %u ", &type, &code, &value) != 3)
+	if (group_find(name, strlen(name)))
 	{
-		dolog(LOG_ERR, "'custom' requires a numeric type, code and value\n");
+		dolog(LOG_ERR, "MPD group %s is defined twice\n", name);
 		return false;
 	}
 
-	/* Check if they are max 16 bits (value is 32bits) */
-	if (type > 0xffff || code > 0xffff)
+	g = calloc(1, sizeof(*g));
+	if (!g || !(g->name = strdup(name)))
 	{
-		dolog(LOG_ERR, "'custom' type/code/value are only 16bits, value provided too large\n");
+		free(g);
+		dolog(LOG_ERR, "Out of memory while adding MPD group %s\n", name);
 		return false;
 	}
 
-	/* Skip over the type/code/value */
-	for (o = 0; c < 3 && buf[o] != '\0'; o++)
+	/* Appended, so -L and the statistics list them in configuration order */
+	for (gp = &groups; *gp; gp = &(*gp)->next);
+	*gp = g;
+
+	while ((host = strtok_r(NULL, " ", &save)) != NULL)
 	{
-		if (buf[o] == ' ') c++;
+		members = realloc(g->members, (g->count + 1) * sizeof(*members));
+		if (!members)
+		{
+			dolog(LOG_ERR, "Out of memory while adding MPD group %s\n", name);
+			return false;
+		}
+		g->members = members;
+
+		memset(&g->members[g->count], 0, sizeof(g->members[0]));
+		if (!server_parse(&g->members[g->count++].server, host)) return false;
 	}
 
-	if (c != 3 || buf[o] == '\0')
+	if (g->count == 0)
 	{
-		dolog(LOG_ERR, "'custom' requires a numeric type, code and value plus a function and optional arguments\n");
+		dolog(LOG_ERR, "MPD group %s has no hosts\n", g->name);
 		return false;
 	}
 
-	if (!which_func(buf, strlen(buf), &o, &func, &arg)) return false;
+	dolog(LOG_DEBUG, "MPD group %s with %u hosts\n", g->name, g->count);
+	return true;
+}
 
-	dolog(LOG_DEBUG,
-		"Mapping Custom Event (type %u, code %u, value %u) to do %s (%s) with arg %s\n",
-		type, code, value,
-		func_map[func].name, func_map[func].desc,
-		arg ? arg : "<none>");
+/* Members are kept parked, like the command connection */
+static void group_state(struct empcd_link *m);
+static void group_state(struct empcd_link *m)
+{
+	if (m->state == EMPCD_LINK_READY) mpd_park(m->conn);
+}
 
-	if (func_map[func].requires_mpd && nompd)
+/* Once the configuration is read, members default to mpd_port */
+static bool group_init(void);
+static bool group_init(void)
+{
+	struct empcd_group	*g;
+	struct empcd_member	*mb;
+	unsigned int		i;
+
+	for (g = groups; g; g = g->next)
 	{
-		dolog(LOG_ERR, "Function requires MPD but MPD is disabled\n");
-		return false;
+		for (i = 0; i < g->count; i++)
+		{
+			mb = &g->members[i];
+
+			if (!mb->server.port && !(mb->server.port = strdup(mpd_port))) return false;
+
+			if (	!mpd_config(&mb->server) ||
+				!link_init(&mb->link, g->name, &mb->server, group_state, mpd_hangup))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void group_start(void);
+static void group_start(void)
+{
+	struct empcd_group	*g;
+	unsigned int		i;
+
+	for (g = groups; g; g = g->next)
+	{
+		for (i = 0; i < g->count; i++) link_start(&g->members[i].link);
 	}
+}
+
+static void group_free(void);
+static void group_free(void)
+{
+	struct empcd_group	*g;
+	struct empcd_member	*mb;
+	unsigned int		i;
+
+	while ((g = groups) != NULL)
+	{
+		groups = g->next;
+
+		for (i = 0; i < g->count; i++)
+		{
+			mb = &g->members[i];
+
+			/* Links only exist when MPD is used */
+			if (!nompd) link_exit(&mb->link);
+
+			free(mb->server.host);
+			free(mb->server.port);
+			free(mb->server.password);
+		}
 
-	return set_event(type, code, value, func_map[func].function, arg, func_map[func].args);
+		free(g->members);
+		free(g->name);
+		free(g);
+	}
 }
 
 /********************************************************************/
 
-/*
-	 0 = failed to open file
-	>0 = all okay (lines read)
-	<0 = error parsing file (line number)
-*/
-static int readconfig(const char *cfgfile, char **device);
-static int readconfig(const char *cfgfile, char **device)
+/* mpd_standby <[password@]host[:port]|socket>, in order of preference */
+static bool standby_add(char *buf);
+static bool standby_add(char *buf)
 {
-	unsigned int	line = 0;
-	int		ret = 0;
-	FILE		*f;
+	if (failover.count >= EMPCD_SERVERS_MAX)
+	{
+		dolog(LOG_ERR, "Too many MPD servers, the maximum is %u\n", EMPCD_SERVERS_MAX);
+		return false;
+	}
 
-	f = fopen(cfgfile, "r");
+	return server_parse(&failover.servers[failover.count++], buf);
+}
 
-	dolog(LOG_DEBUG, "ReadConfig(%s) = %s\n", cfgfile, f ? "ok" : "error");
+static unsigned int failover_us(const struct timespec *since);
+static unsigned int failover_us(const struct timespec *since)
+{
+	struct timespec now;
 
-	if (!f) return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
 
-	while (!feof(f) && ret == 0)
+/* Point the command and status links at another server */
+static void failover_switch(unsigned int to);
+static void failover_switch(unsigned int to)
+{
+	struct empcd_link	*links[2] = { &mpd_cmd, &mpd_stat };
+	struct empcd_link	*m;
+	unsigned int		i;
+
+	dolog(LOG_WARNING, "MPD switching from %s (%s) to %s\n",
+		failover.servers[failover.active].where,
+		failover.probes[failover.active].down ? "unhealthy" : "a preferred server is back",
+		failover.servers[to].where);
+
+	clock_gettime(CLOCK_MONOTONIC, &failover.started);
+	failover.switching = true;
+	__atomic_store_n(&failover.active, to, __ATOMIC_RELAXED);
+
+	/* The breaker was about the old server */
+	__atomic_store_n(&breaker.state, EMPCD_BREAKER_CLOSED, __ATOMIC_RELAXED);
+	breaker.failures = 0;
+	breaker.cooldown = EMPCD_BREAKER_COOLDOWN;
+
+	for (i = 0; i < 2; i++)
 	{
-		char buf[1024], buf2[1024];
-		unsigned int n, i = 0, j = 0;
+		m = links[i];
 
-		line++;
+		link_close(m);
+		link_arm(m, 0);
 
-		if (fgets(buf2, sizeof(buf2), f) == 0) break;
-		n = strlen(buf2)-1;
+		if (m->addrs && m->addrs != &m->local) freeaddrinfo(m->addrs);
+		m->addrs = NULL;
 
-		/*
-		 * Trim whitespace
-		 * - Translate \t to space
-		 * - strip multiple whitespaces
-		 * Saves handling them below
-		 */
-		for (i=0,j=0; i<n; i++)
-		{
-			if (buf2[i] == '\t') buf2[i] = ' ';
-			if (	(i == 0 || (i > 0 && buf2[i-1] == ' ')) &&
-				(buf2[i] == ' ' || buf2[i] == '\t'))
-			{
-				continue;
-			}
+		m->server = &failover.servers[to];
+		m->backoff = EMPCD_BACKOFF_MIN;
+	}
 
-			buf[j++] = buf2[i];
-		}
+	/* The status link follows once the command link is ready */
+	link_start(&mpd_cmd);
+}
+
+/*
+ * The first healthy server is the one to use. Only leave the active one
+ * for a preferred server or when it is down, not while its state is
+ * still unknown (startup), and stay put when none is healthy.
+ */
+static void failover_check(void);
+static void failover_check(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < failover.count && !failover.probes[i].healthy; i++);
+
+	if (i >= failover.count || i == failover.active) return;
+
+	if (i < failover.active || failover.probes[failover.active].down) failover_switch(i);
+}
+
+/* (Re-)arm the probe timer, unless it already runs at that interval */
+static void probe_arm(unsigned int ms);
+static void probe_arm(unsigned int ms)
+{
+	struct itimerspec its;
+
+	if (ms == failover.interval) return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(failover.timer.fd, 0, &its, NULL) < 0)
+	{
+		doelog(LOG_ERR, errno, "Couldn't arm the MPD probe timer\n");
+		return;
+	}
+
+	failover.interval = ms;
+}
+
+static void probe_result(struct empcd_probe *p, bool ok);
+static void probe_result(struct empcd_probe *p, bool ok)
+{
+	STAT_ADD(p->probes, 1);
+
+	if (ok)
+	{
+		p->fails = 0;
+		if (p->healthy || ++p->oks < EMPCD_PROBE_RECOVER) return;
+
+		dolog(LOG_INFO, "MPD %s is healthy, ping %u us\n", p->link.server->where, p->rtt);
+		p->healthy = true;
+		p->down = false;
+	}
+	else
+	{
+		STAT_ADD(p->failures, 1);
+		p->oks = 0;
+
+		/* Something is off, find out soon */
+		probe_arm(EMPCD_PROBE_INTERVAL);
+
+		if (p->down || ++p->fails < EMPCD_PROBE_FAILS) return;
+
+		dolog(LOG_WARNING, "MPD %s failed its health check\n", p->link.server->where);
+		p->healthy = false;
+		p->down = true;
+	}
+
+	failover_check();
+}
+
+/* A failed connection is a failed probe */
+static void probe_state(struct empcd_link *m);
+static void probe_state(struct empcd_link *m)
+{
+	if (m->state == EMPCD_LINK_BACKOFF) probe_result((struct empcd_probe *)m, false);
+}
+
+/* The answer to a ping, or MPD closing the connection */
+static void probe_answer(struct empcd_link *m, uint32_t events);
+static void probe_answer(struct empcd_link *m, uint32_t UNUSED events)
+{
+	struct empcd_probe	*p = (struct empcd_probe *)m;
+	struct timespec		now;
+
+	/* MPD only talks when asked */
+	if (!p->pending)
+	{
+		link_backoff(m, "connection closed by MPD");
+		return;
+	}
+
+	mpd_finishCommand(m->conn);
+	if (m->conn->error)
+	{
+		link_backoff(m, m->conn->errorStr);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	p->rtt = (now.tv_sec - p->sent.tv_sec) * 1000000 + (now.tv_nsec - p->sent.tv_nsec) / 1000;
+	p->pending = false;
+
+	/* A ping may take as long as at the shortest interval, whatever the current one is */
+	probe_result(p, p->rtt <= EMPCD_PROBE_INTERVAL * 1000);
+}
+
+/* Every interval: a ping to each server, an unanswered one is a failure */
+static void probe_tick(struct empcd_watch *w, uint32_t events);
+static void probe_tick(struct empcd_watch *w, uint32_t UNUSED events)
+{
+	struct empcd_probe	*p;
+	uint64_t		expirations;
+	unsigned int		i;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+	for (i = 0; i < failover.count; i++)
+	{
+		p = &failover.probes[i];
+
+		if (p->link.state != EMPCD_LINK_READY)
+		{
+			if (p->link.state == EMPCD_LINK_DOWN) link_start(&p->link);
+			continue;
+		}
+
+		if (p->pending)
+		{
+			p->pending = false;
+			link_backoff(&p->link, "ping not answered in time");
+			continue;
+		}
+
+		mpd_setDeadline(p->link.conn, EMPCD_PROBE_INTERVAL);
+		mpd_sendPingCommand(p->link.conn);
+		if (p->link.conn->error)
+		{
+			link_backoff(&p->link, p->link.conn->errorStr);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &p->sent);
+		p->pending = true;
+	}
+
+	/* While every server is fine there is little to learn, probe less often */
+	for (i = 0; i < failover.count && failover.probes[i].healthy && failover.probes[i].fails == 0; i++);
+
+	if (i < failover.count) probe_arm(EMPCD_PROBE_INTERVAL);
+	else if (failover.interval < EMPCD_PROBE_IDLE) probe_arm(failover.interval * 2 < EMPCD_PROBE_IDLE ? failover.interval * 2 : EMPCD_PROBE_IDLE);
+}
+
+/* Standbys have their port defaulted and get probed, without them nothing changes */
+static bool failover_init(void);
+static bool failover_init(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < failover.count; i++)
+	{
+		if (!failover.servers[i].port && !(failover.servers[i].port = strdup(mpd_port))) return false;
+		if (!mpd_config(&failover.servers[i])) return false;
+	}
+
+	if (failover.count < 2) return true;
+
+	for (i = 0; i < failover.count; i++)
+	{
+		if (!link_init(&failover.probes[i].link, "probe", &failover.servers[i], probe_state, probe_answer)) return false;
+	}
+
+	failover.timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (failover.timer.fd < 0)
+	{
+		doelog(LOG_ERR, errno, "Couldn't create the MPD probe timer\n");
+		return false;
+	}
+
+	failover.timer.handler = probe_tick;
+	failover.timer.data = &failover;
+
+	return loop_add(&exec_loop, &failover.timer, EPOLLIN);
+}
+
+/* Without a standby there is nothing to probe, the timer stays disarmed */
+static void failover_start(void);
+static void failover_start(void)
+{
+	unsigned int i;
+
+	if (failover.count < 2) return;
+
+	for (i = 0; i < failover.count; i++) link_start(&failover.probes[i].link);
+
+	probe_arm(EMPCD_PROBE_INTERVAL);
+}
+
+static void failover_exit(void);
+static void failover_exit(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < failover.count; i++)
+	{
+		free(failover.servers[i].host);
+		free(failover.servers[i].port);
+		free(failover.servers[i].password);
+	}
+
+	/* Probes only exist with standbys and MPD */
+	if (nompd || failover.count < 2) return;
+
+	for (i = 0; i < failover.count; i++) link_exit(&failover.probes[i].link);
+
+	loop_del(&exec_loop, &failover.timer);
+	close(failover.timer.fd);
+}
+
+/********************************************************************/
+
+/*
+ * exec children
+ * posix_spawn() instead of system(), the executor doesn't wait for the
+ * command, the SIGCHLD signalfd tells when to reap it. Commands without
+ * shell syntax are split at configuration time and skip /bin/sh.
+ */
+static char **exec_split(const char *cmd);
+static char **exec_split(const char *cmd)
+{
+	unsigned int	words = 0, i;
+	const char	*c, *space, *eq;
+	char		**argv, *p;
+	bool		inword = false;
+
+	/* Quoting, expansion, redirection etc are for the shell */
+	if (strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~{}!\n")) return NULL;
+
+	/* And so are assignments in front of the command */
+	space = strpbrk(cmd, " \t");
+	eq = strchr(cmd, '=');
+	if (eq && (!space || eq < space)) return NULL;
+
+	/* Words are split on blanks, like the shell does */
+	for (c = cmd; *c; c++)
+	{
+		if (*c == ' ' || *c == '\t') inword = false;
+		else if (!inword)
+		{
+			inword = true;
+			words++;
+		}
+	}
+
+	if (words == 0) return NULL;
+
+	/* One allocation, the pointers followed by the words */
+	argv = malloc((words + 1) * sizeof(*argv) + strlen(cmd) + 1);
+	if (!argv) return NULL;
+
+	p = (char *)&argv[words + 1];
+	strcpy(p, cmd);
+
+	for (i = 0; *p; )
+	{
+		while (*p == ' ' || *p == '\t') *p++ = '\0';
+		if (*p == '\0') break;
+
+		argv[i++] = p;
+		while (*p && *p != ' ' && *p != '\t') p++;
+	}
+	argv[i] = NULL;
+
+	return argv;
+}
+
+static unsigned int children_of(const struct empcd_events *evt);
+static unsigned int children_of(const struct empcd_events *evt)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < children.count; i++)
+	{
+		if (children.list[i].evt == evt) n++;
+	}
+
+	return n;
+}
+
+/* Start cmd, for evt (NULL for none) within its limit */
+static void exec_spawn(const struct empcd_events *evt, const char *cmd);
+static void exec_spawn(const struct empcd_events *evt, const char *cmd)
+{
+	char			*shell[] = { (char *)"sh", (char *)"-c", (char *)cmd, NULL };
+	struct empcd_child	*child;
+	unsigned int		busy = evt ? children_of(evt) : 0;
+	pid_t			pid;
+	int			err;
+
+	if (children.count >= EMPCD_CHILDREN_MAX)
+	{
+		dolog(LOG_WARNING, "exec '%s' not started, already %u children running\n", cmd, children.count);
+		STAT_ADD(children.limited, 1);
+		return;
+	}
+
+	if (evt && evt->limit > 0 && busy >= evt->limit)
+	{
+		dolog(LOG_INFO, "exec '%s' not started, %u of %u still running\n", cmd, busy, evt->limit);
+		STAT_ADD(children.limited, 1);
+		return;
+	}
+
+	if (evt && evt->argv)
+	{
+		err = posix_spawnp(&pid, evt->argv[0], NULL, &children.attr, evt->argv, environ);
+	}
+	else
+	{
+		err = posix_spawn(&pid, "/bin/sh", NULL, &children.attr, shell, environ);
+		STAT_ADD(children.shell, 1);
+	}
+
+	if (err != 0)
+	{
+		doelog(LOG_WARNING, err, "exec failed to start '%s'\n", cmd);
+		STAT_ADD(children.failed, 1);
+		return;
+	}
+
+	/* The count is read by empcd_stats() in the main thread */
+	child = &children.list[__atomic_add_fetch(&children.count, 1, __ATOMIC_RELAXED) - 1];
+	child->pid = pid;
+	child->evt = evt;
+	clock_gettime(CLOCK_MONOTONIC, &child->started);
+	STAT_ADD(children.spawned, 1);
+
+	dolog(LOG_DEBUG, "exec started '%s' as PID %d%s\n", cmd, (int)pid, evt && evt->argv ? "" : " through /bin/sh");
+}
+
+/*
+ * Coprocesses
+ * Started before the privileges are dropped, restarts run with
+ * the dropped ones. Lines are at most PIPE_BUF, a write() of one
+ * thus either goes in completely or not at all.
+ */
+static struct empcd_coproc *coproc_find(const char *name, unsigned int len);
+static struct empcd_coproc *coproc_find(const char *name, unsigned int len)
+{
+	struct empcd_coproc *cp;
+
+	for (cp = coprocs; cp; cp = cp->next)
+	{
+		if (strlen(cp->name) == len && strncasecmp(cp->name, name, len) == 0) break;
+	}
+
+	return cp;
+}
+
+/* coproc <name> <command> */
+static bool coproc_add(const char *buf);
+static bool coproc_add(const char *buf)
+{
+	struct empcd_coproc	*cp, **cpp;
+	const char		*command = strchr(buf, ' ');
+
+	if (!command || command == buf || command[1] == '\0')
+	{
+		dolog(LOG_ERR, "coproc requires a name and a command\n");
+		return false;
+	}
+
+	if (coproc_find(buf, command - buf))
+	{
+		dolog(LOG_ERR, "coproc %.*s is defined twice\n", (int)(command - buf), buf);
+		return false;
+	}
+
+	cp = calloc(1, sizeof(*cp));
+	if (!cp || !(cp->name = strndup(buf, command - buf)) || !(cp->command = strdup(command + 1)))
+	{
+		if (cp) free(cp->name);
+		free(cp);
+		dolog(LOG_ERR, "Out of memory while adding coproc %.*s\n", (int)(command - buf), buf);
+		return false;
+	}
+
+	cp->argv = exec_split(cp->command);
+	cp->watch.fd = -1;
+	cp->timer.fd = -1;
+
+	for (cpp = &coprocs; *cpp; cpp = &(*cpp)->next);
+	*cpp = cp;
+
+	return true;
+}
+
+static void coproc_close(struct empcd_coproc *cp);
+static void coproc_close(struct empcd_coproc *cp)
+{
+	if (cp->watch.fd < 0) return;
+
+	loop_del(&exec_loop, &cp->watch);
+	close(cp->watch.fd);
+	cp->watch.fd = -1;
+}
+
+/* Write what is buffered, false when the helper is gone */
+static bool coproc_flush(struct empcd_coproc *cp);
+static bool coproc_flush(struct empcd_coproc *cp)
+{
+	ssize_t n;
+
+	while (cp->len > 0)
+	{
+		n = write(cp->watch.fd, cp->buf, cp->len);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+
+			/* EPIPE, the restart follows when it is reaped */
+			coproc_close(cp);
+			return false;
+		}
+
+		/* The length is read by empcd_stats() in the main thread */
+		memmove(cp->buf, &cp->buf[n], __atomic_sub_fetch(&cp->len, (unsigned int)n, __ATOMIC_RELAXED));
+	}
+
+	if (cp->len == 0) cp->stalled = false;
+
+	/* Only wait for room while there is something to write */
+	return loop_mod(&exec_loop, &cp->watch, cp->len > 0 ? EPOLLOUT : 0);
+}
+
+static void coproc_writable(struct empcd_watch *w, uint32_t events);
+static void coproc_writable(struct empcd_watch *w, uint32_t events)
+{
+	struct empcd_coproc *cp = w->data;
+
+	/* The reader is gone */
+	if (cp->len == 0 && (events & EPOLLERR))
+	{
+		coproc_close(cp);
+		return;
+	}
+
+	coproc_flush(cp);
+}
+
+static bool coproc_start(struct empcd_coproc *cp);
+static bool coproc_start(struct empcd_coproc *cp)
+{
+	char				*shell[] = { (char *)"sh", (char *)"-c", cp->command, NULL };
+	posix_spawn_file_actions_t	fa;
+	pid_t				pid = 0;
+	int				fds[2], err;
+
+	/* Close-on-exec from the start, no other spawn can inherit the pipe */
+	if (pipe2(fds, O_CLOEXEC) < 0)
+	{
+		doelog(LOG_ERR, errno, "coproc %s: couldn't create a pipe\n", cp->name);
+		return false;
+	}
+
+	/* dup2() clears O_CLOEXEC for the stdin of the helper only */
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fds[0], STDIN_FILENO);
+
+	if (cp->argv) err = posix_spawnp(&pid, cp->argv[0], &fa, &children.attr, cp->argv, environ);
+	else err = posix_spawn(&pid, "/bin/sh", &fa, &children.attr, shell, environ);
+
+	posix_spawn_file_actions_destroy(&fa);
+	close(fds[0]);
+
+	if (err != 0)
+	{
+		doelog(LOG_ERR, err, "coproc %s: failed to start '%s'\n", cp->name, cp->command);
+		close(fds[1]);
+		return false;
+	}
+
+	/* The PID is shown by empcd_stats() in the main thread */
+	__atomic_store_n(&cp->pid, pid, __ATOMIC_RELAXED);
+
+	clock_gettime(CLOCK_MONOTONIC, &cp->started);
+	dolog(LOG_DEBUG, "coproc %s started '%s' as PID %d\n", cp->name, cp->command, (int)pid);
+
+	cp->watch.fd = fds[1];
+	cp->watch.handler = coproc_writable;
+	cp->watch.data = cp;
+	if (	fcntl(cp->watch.fd, F_SETFL, O_NONBLOCK) < 0 ||
+		!loop_add(&exec_loop, &cp->watch, 0))
+	{
+		close(cp->watch.fd);
+		cp->watch.fd = -1;
+		return false;
+	}
+
+	/* Whatever was kept while it was down */
+	return cp->len == 0 || coproc_flush(cp);
+}
+
+static bool coproc_schedule(struct empcd_coproc *cp, unsigned int secs);
+static bool coproc_schedule(struct empcd_coproc *cp, unsigned int secs)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = secs;
+
+	if (timerfd_settime(cp->timer.fd, 0, &its, NULL) < 0)
+	{
+		doelog(LOG_ERR, errno, "coproc %s: couldn't arm the restart timer\n", cp->name);
+		return false;
+	}
+
+	return true;
+}
+
+static void coproc_restart(struct empcd_coproc *cp);
+static void coproc_restart(struct empcd_coproc *cp)
+{
+	if (cp->pid != 0) return;
+
+	STAT_ADD(cp->restarts, 1);
+	if (!coproc_start(cp)) coproc_schedule(cp, EMPCD_COPROC_RESTART);
+}
+
+static void coproc_timer(struct empcd_watch *w, uint32_t events);
+static void coproc_timer(struct empcd_watch *w, uint32_t UNUSED events)
+{
+	uint64_t expirations;
+
+	while (read(w->fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+
+	coproc_restart(w->data);
+}
+
+/* Reaped, true when pid was a coproc */
+static bool coproc_reaped(pid_t pid, int status, const struct timespec *now);
+static bool coproc_reaped(pid_t pid, int status, const struct timespec *now)
+{
+	struct empcd_coproc	*cp;
+	unsigned int		ms;
+
+	for (cp = coprocs; cp && cp->pid != pid; cp = cp->next);
+	if (!cp) return false;
+
+	ms = (now->tv_sec - cp->started.tv_sec) * 1000 + (now->tv_nsec - cp->started.tv_nsec) / 1000000;
+	if (WIFSIGNALED(status)) dolog(LOG_WARNING, "coproc %s (PID %d) killed by signal %d after %u ms, restarting\n", cp->name, (int)pid, WTERMSIG(status), ms);
+	else dolog(LOG_WARNING, "coproc %s (PID %d) exited with %d after %u ms, restarting\n", cp->name, (int)pid, WEXITSTATUS(status), ms);
+
+	__atomic_store_n(&cp->pid, 0, __ATOMIC_RELAXED);
+	coproc_close(cp);
+
+	/* Right away, unless it didn't even last a second */
+	if (ms >= EMPCD_COPROC_RESTART * 1000) coproc_restart(cp);
+	else coproc_schedule(cp, EMPCD_COPROC_RESTART);
+
+	return true;
+}
+
+static void coproc_write(struct empcd_coproc *cp, const char *line, unsigned int len);
+static void coproc_write(struct empcd_coproc *cp, const char *line, unsigned int len)
+{
+	ssize_t n;
+
+	STAT_ADD(cp->lines, 1);
+
+	/* The common case: nothing pending, straight into the pipe */
+	if (cp->len == 0 && cp->watch.fd >= 0)
+	{
+		do n = write(cp->watch.fd, line, len);
+		while (n < 0 && errno == EINTR);
+
+		if (n == (ssize_t)len) return;
+		if (n < 0 && errno != EAGAIN) coproc_close(cp);
+	}
+
+	if (len > sizeof(cp->buf) - cp->len)
+	{
+		if (!cp->stalled) dolog(LOG_WARNING, "coproc %s isn't reading, dropping lines\n", cp->name);
+		cp->stalled = true;
+		STAT_ADD(cp->dropped, 1);
+		return;
+	}
+
+	memcpy(&cp->buf[cp->len], line, len);
+	(void)__atomic_add_fetch(&cp->len, len, __ATOMIC_RELAXED);
+
+	if (cp->watch.fd >= 0) loop_mod(&exec_loop, &cp->watch, EPOLLOUT);
+}
+
+/* Before the privileges are dropped and the executor runs */
+static bool coproc_init(void);
+static bool coproc_init(void)
+{
+	struct empcd_coproc *cp;
+
+	for (cp = coprocs; cp; cp = cp->next)
+	{
+		cp->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		cp->timer.handler = coproc_timer;
+		cp->timer.data = cp;
+		if (cp->timer.fd < 0 || !loop_add(&exec_loop, &cp->timer, EPOLLIN))
+		{
+			doelog(LOG_ERR, errno, "coproc %s: couldn't create the restart timer\n", cp->name);
+			return false;
+		}
+
+		if (!coproc_start(cp)) return false;
+	}
+
+	return true;
+}
+
+/* Closing stdin tells the helpers to finish */
+static void coproc_exit(void);
+static void coproc_exit(void)
+{
+	struct empcd_coproc *cp;
+
+	while ((cp = coprocs) != NULL)
+	{
+		coprocs = cp->next;
+
+		if (cp->len > 0) dolog(LOG_DEBUG, "coproc %s: %u bytes not written\n", cp->name, cp->len);
+
+		coproc_close(cp);
+		if (cp->timer.fd >= 0)
+		{
+			loop_del(&exec_loop, &cp->timer);
+			close(cp->timer.fd);
+		}
+
+		free(cp->argv);
+		free(cp->command);
+		free(cp->name);
+		free(cp);
+	}
+}
+
+static void children_reap(struct empcd_watch *w, uint32_t events);
+static void children_reap(struct empcd_watch *w, uint32_t UNUSED events)
+{
+	struct signalfd_siginfo	si;
+	struct empcd_child	*child;
+	struct timespec		now;
+	unsigned int		i, ms;
+	pid_t			pid;
+	int			status;
+
+	/* SIGCHLDs get merged, waitpid tells which children are done */
+	while (read(w->fd, &si, sizeof(si)) == sizeof(si));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		if (coproc_reaped(pid, status, &now)) continue;
+
+		for (i = 0; i < children.count && children.list[i].pid != pid; i++);
+		if (i == children.count) continue;
+
+		child = &children.list[i];
+		ms = (now.tv_sec - child->started.tv_sec) * 1000 + (now.tv_nsec - child->started.tv_nsec) / 1000000;
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		{
+			dolog(LOG_DEBUG, "exec PID %d done after %u ms\n", (int)pid, ms);
+		}
+		else if (WIFEXITED(status))
+		{
+			dolog(LOG_WARNING, "exec PID %d exited with %d after %u ms\n", (int)pid, WEXITSTATUS(status), ms);
+		}
+		else
+		{
+			dolog(LOG_WARNING, "exec PID %d killed by signal %d after %u ms\n", (int)pid, WTERMSIG(status), ms);
+		}
+
+		children.list[i] = children.list[__atomic_sub_fetch(&children.count, 1, __ATOMIC_RELAXED)];
+	}
+}
+
+/* Before the executor starts, SIGCHLD has to be blocked in every thread */
+static bool children_init(void);
+static bool children_init(void)
+{
+	sigset_t sigs, none, def;
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+	children.watch.fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	children.watch.handler = children_reap;
+	if (children.watch.fd < 0 || !loop_add(&exec_loop, &children.watch, EPOLLIN))
+	{
+		doelog(LOG_ERR, errno, "Couldn't setup SIGCHLD handling\n");
+		return false;
+	}
+
+	/* Children start with nothing blocked and what we ignore back to the default */
+	sigemptyset(&none);
+	sigemptyset(&def);
+	sigaddset(&def, SIGPIPE);
+	sigaddset(&def, SIGUSR2);
+	sigaddset(&def, SIGILL);
+	sigaddset(&def, SIGABRT);
+	sigaddset(&def, SIGTSTP);
+	sigaddset(&def, SIGTTIN);
+	sigaddset(&def, SIGTTOU);
+
+	posix_spawnattr_init(&children.attr);
+	posix_spawnattr_setsigmask(&children.attr, &none);
+	posix_spawnattr_setsigdefault(&children.attr, &def);
+	posix_spawnattr_setflags(&children.attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	return true;
+}
+
+static void children_exit(void);
+static void children_exit(void)
+{
+	if (children.watch.fd < 0) return;
+
+	/* Whatever still runs is left alone, like it was with system() */
+	if (children.count > 0) dolog(LOG_DEBUG, "Leaving %u exec children running\n", children.count);
+
+	loop_del(&exec_loop, &children.watch);
+	close(children.watch.fd);
+	children.watch.fd = -1;
+	posix_spawnattr_destroy(&children.attr);
+}
+
+static void f_exec(const char *arg, const char *args);
+static void f_exec(const char *arg, const char *args)
+{
+	if ((!arg || strlen(arg) == 0) && args)
+	{
+		dolog(LOG_WARNING, "f_exec requires '%s' as an argument, none given, ignoring\n", args);
+		return;
+	}
+
+	/* Mappings go through evt_run(), which applies their limit */
+	exec_spawn(NULL, arg);
+}
+
+/* Mappings have their line ready, this is for anything else */
+static void f_coproc(const char *arg, const char *args);
+static void f_coproc(const char *arg, const char *args)
+{
+	struct empcd_coproc	*cp;
+	const char		*line = arg ? strchr(arg, ' ') : NULL;
+	char			buf[PIPE_BUF];
+	int			len;
+
+	if (!line)
+	{
+		dolog(LOG_WARNING, "f_coproc requires '%s' as an argument, ignoring\n", args);
+		return;
+	}
+
+	cp = coproc_find(arg, line - arg);
+	if (!cp)
+	{
+		dolog(LOG_WARNING, "Unknown coproc '%.*s', ignoring\n", (int)(line - arg), arg);
+		return;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%s\n", line + 1);
+	if (len < 0 || len >= (int)sizeof(buf)) return;
+
+	coproc_write(cp, buf, len);
+}
+
+static void f_quit(const char UNUSED *arg, const char UNUSED *args);
+static void f_quit(const char UNUSED *arg, const char UNUSED *args)
+{
+	/* We run in the executor, let the main loop shut everything down */
+	kill(getpid(), SIGTERM);
+}
+
+#define QUOTE(s) #s
+#define STR(s) QUOTE(s)
+#define F_CMDG(fn, ms, f, r)										\
+static void f_##fn(const char *arg, const char *args);							\
+static void f_##fn(const char *arg, const char *args)							\
+{													\
+	if (nompd)											\
+	{												\
+		dolog(LOG_INFO, "%s not executing as MPD is disabled (nompd)\n", STR(fn));		\
+		return;											\
+	}												\
+													\
+	if ((!arg || strlen(arg) == 0) && args)								\
+	{												\
+		dolog(LOG_WARNING, "%s requires '%s' as an argument, none given, ignoring\n", #fn, args); \
+		return;											\
+	}												\
+													\
+	MPD_CMDD(ms, f);										\
+}													\
+													\
+static char *r_##fn(const char *arg, unsigned int *deadline);						\
+static char *r_##fn(const char UNUSED *arg, unsigned int *deadline)					\
+{													\
+	*deadline = ms;											\
+	return r;											\
+}
+
+/*
+ * f_<fn> executes the command within the ms deadline, r_<fn> renders it for set_event
+ * G = Given argument, N = No Argument, A = 'arg' as argument */
+#define F_CMDN(fn, ms, f, c)	F_CMDG(fn,ms,f(mpd),mpd_renderCommand(c, NULL))
+#define F_CMDA(fn, ms, f, c)	F_CMDG(fn,ms,f(mpd, arg),(arg && arg[0] != '\0') ? mpd_renderCommand(c, arg) : NULL)
+
+F_CMDN(next,	EMPCD_DEADLINE_CMD,	mpd_sendNextCommand,	"next")
+F_CMDN(prev,	EMPCD_DEADLINE_CMD,	mpd_sendPrevCommand,	"previous")
+F_CMDN(stop,	EMPCD_DEADLINE_CMD,	mpd_sendStopCommand,	"stop")
+F_CMDG(play,	EMPCD_DEADLINE_CMD,	mpd_sendPlayCommand(mpd,-1), mpd_renderCommand("play", "-1"))
+F_CMDA(save,	EMPCD_DEADLINE_SLOW,	mpd_sendSaveCommand,	"save")
+F_CMDA(load,	EMPCD_DEADLINE_SLOW,	mpd_sendLoadCommand,	"load")
+F_CMDA(remove,	EMPCD_DEADLINE_CMD,	mpd_sendRmCommand,	"rm")
+F_CMDN(clear,	EMPCD_DEADLINE_CMD,	mpd_sendClearCommand,	"clear")
+
+/* Anything empcd doesn't wrap, the argument is the protocol line as is */
+static void f_raw(const char *arg, const char *args);
+static void f_raw(const char *arg, const char *args)
+{
+	/* With an argument the mapping has its line rendered, see r_raw */
+	if (nompd) dolog(LOG_INFO, "raw not executing as MPD is disabled (nompd)\n");
+	else if (!arg || arg[0] == '\0') dolog(LOG_WARNING, "raw requires '%s' as an argument, none given, ignoring\n", args);
+}
+
+static char *r_raw(const char *arg, unsigned int *deadline);
+static char *r_raw(const char *arg, unsigned int *deadline)
+{
+	char *line;
+
+	if (!arg || arg[0] == '\0') return NULL;
+
+	/* It could be anything, give it the time of a slow command */
+	*deadline = EMPCD_DEADLINE_SLOW;
+
+	line = malloc(strlen(arg) + 2);
+	if (line) sprintf(line, "%s\n", arg);
+	return line;
+}
+
+/*
+ * Parse "[+|-]<val>[%]" as used by mpd_seek and mpd_volume
+ * Relative values are signed, absolute ones are not.
+ */
+static bool parse_adjust(const char *arg, struct empcd_adjust *adj);
+static bool parse_adjust(const char *arg, struct empcd_adjust *adj)
+{
+	char	*end;
+	long	val;
+
+	if (!arg || arg[0] == '\0') return false;
+
+	adj->relative = (arg[0] == '-' || arg[0] == '+');
+
+	val = strtol(arg, &end, 10);
+	if (end == arg) return false;
+
+	adj->perc = (end[0] == '%');
+	adj->val = val;
+
+	return true;
+}
+
+/* Fold b into a, false when they can't be combined */
+static bool merge_adjust(struct empcd_adjust *a, const struct empcd_adjust *b);
+static bool merge_adjust(struct empcd_adjust *a, const struct empcd_adjust *b)
+{
+	/* An absolute value overrides whatever came before it */
+	if (!b->relative)
+	{
+		*a = *b;
+		return true;
+	}
+
+	if (a->perc != b->perc) return false;
+
+	a->val += b->val;
+	return true;
+}
+
+static void mpd_volume(const struct empcd_adjust *adj);
+static void mpd_volume(const struct empcd_adjust *adj)
+{
+	int			volume;
+	struct empcd_status	st;
+
+	/* Without the mirror the status costs a round-trip, let MPD do the math */
+	if (!mirror.valid && !adj->perc)
+	{
+		if (!adj->relative)
+		{
+			volume = adj->val < 0 ? 0 : (adj->val > 100 ? 100 : adj->val);
+			MPD_CMD(mpd_sendSetvolCommand(mpd, volume));
+			return;
+		}
+
+		if (MPD_HAS(EMPCD_CAP_VOLUME))
+		{
+			MPD_CMD(mpd_sendVolumeCommand(mpd, adj->val));
+			return;
+		}
+	}
+
+	if (!status_get(&st)) return;
+
+	/* Percentages are of the current volume */
+	volume = adj->perc ? (st.volume * adj->val / 100) : adj->val;
+	if (adj->relative) volume += st.volume;
+
+	/* Take care of limits */
+	if (volume < 0) volume = 0;
+	if (volume > 100) volume = 100;
+
+	if (volume == st.volume) return;
+
+	MPD_CMD(mpd_sendSetvolCommand(mpd, volume));
+
+	/* Don't wait for idle to tell us, the next repeat might come sooner */
+	if (MPD_OK()) mirror.volume = volume;
+}
+
+static void f_volume(const char *arg, const char UNUSED *args);
+static void f_volume(const char *arg, const char UNUSED *args)
+{
+	struct empcd_adjust adj;
+
+	if (!parse_adjust(arg, &adj))
+	{
+		dolog(LOG_WARNING, "mpd_volume requires '[+|-]<val>[%%]' as an argument, ignoring\n");
+		return;
+	}
+
+	mpd_volume(&adj);
+}
+
+/* Only a plain absolute volume, a percentage is of the current one */
+static char *r_volume(const char *arg, unsigned int *deadline);
+static char *r_volume(const char *arg, unsigned int *deadline)
+{
+	struct empcd_adjust	adj;
+	char			volume[16];
+
+	*deadline = EMPCD_DEADLINE_CMD;
+
+	if (!parse_adjust(arg, &adj) || adj.relative || adj.perc) return NULL;
+
+	snprintf(volume, sizeof(volume), "%d", adj.val < 0 ? 0 : (adj.val > 100 ? 100 : adj.val));
+	return mpd_renderCommand("setvol", volume);
+}
+
+static void mpd_seek(const struct empcd_adjust *adj);
+static void mpd_seek(const struct empcd_adjust *adj)
+{
+	int			seekto;
+	struct empcd_status	st;
+
+	/* Same for seeking, limits are up to MPD then */
+	if (!mirror.valid && !adj->perc && MPD_HAS(EMPCD_CAP_SEEKCUR))
+	{
+		MPD_CMD(mpd_sendSeekCurCommand(mpd, adj->relative ? adj->val : (adj->val < 0 ? 0 : adj->val), adj->relative));
+		return;
+	}
+
+	if (!status_get(&st)) return;
+
+	/* Nothing to seek in when stopped or in a stream */
+	if (	(st.state != MPD_STATUS_STATE_PLAY && st.state != MPD_STATUS_STATE_PAUSE) ||
+		st.total <= 10)
+	{
+		return;
+	}
+
+	/* Percentages are of the total time of the song */
+	seekto = adj->perc ? (st.total * adj->val / 100) : adj->val;
+	if (adj->relative) seekto += (st.elapsed + 500) / 1000;
+
+	/*
+	 * Take care of limits
+	 * (end-10 so that one can search till the end easily)
+	 */
+	if (seekto > (st.total-10)) seekto = st.total-10;
+	if (seekto < 0) seekto = 0;
+
+	MPD_CMD(mpd_sendSeekIdCommand(mpd, st.songid, seekto));
+
+	if (MPD_OK() && mirror.valid && mirror.songid == st.songid)
+	{
+		mirror.elapsed = seekto * 1000;
+		clock_gettime(CLOCK_MONOTONIC, &mirror.at);
+	}
+}
+
+static void f_seek(const char *arg, const char UNUSED *args);
+static void f_seek(const char *arg, const char UNUSED *args)
+{
+	struct empcd_adjust adj;
+
+	if (!parse_adjust(arg, &adj))
+	{
+		dolog(LOG_WARNING, "mpd_seek requires '[+|-]<val>[%%]' as an argument, ignoring\n");
+		return;
+	}
+
+	mpd_seek(&adj);
+}
+
+/* skip times next (positive) or previous (negative) in one command list */
+static void mpd_sendSkipCommands(int skip);
+static void mpd_sendSkipCommands(int skip)
+{
+	int i;
+
+	mpd_sendCommandListBegin(mpd);
+	for (i = 0; i < abs(skip); i++)
+	{
+		if (skip > 0) mpd_sendNextCommand(mpd);
+		else mpd_sendPrevCommand(mpd);
+	}
+	mpd_sendCommandListEnd(mpd);
+}
+
+/*
+ * Skip songs forward (positive) or backward (negative)
+ * Used for coalescing next/prev, one play instead of N next commands.
+ * Only while playing, as next/prev don't start a stopped/paused player.
+ */
+static bool mpd_skip(int skip);
+static bool mpd_skip(int skip)
+{
+	int			pos;
+	struct empcd_status	st;
+
+	if (!status_get(&st)) return false;
+
+	if (st.state != MPD_STATUS_STATE_PLAY || st.length <= 0) return false;
+
+	/* Only in a plain linear queue is the next song the next position */
+	if (st.random || st.consume || st.single)
+	{
+		MPD_CMD(mpd_sendSkipCommands(skip));
+		mirror.valid = false;
+		return true;
+	}
+
+	pos = st.song + skip;
+	if (st.repeat) pos = ((pos % st.length) + st.length) % st.length;
+	else if (pos < 0) pos = 0;
+
+	/* A next past the last song stops, so do the skips */
+	if (pos >= st.length) MPD_CMD(mpd_sendStopCommand(mpd));
+	else MPD_CMD(mpd_sendPlayCommand(mpd, pos));
+
+	/* The song id is unknown till idle reports it */
+	mirror.valid = false;
+	return true;
+}
+
+/* "[toggle|on|off]" as used by pause and random: -1 toggle, 1 on, 0 off */
+static int parse_mode(const char *arg);
+static int parse_mode(const char *arg)
+{
+	if (!arg || strlen(arg) == 0 || (strcasecmp(arg, "toggle") == 0)) return -1;
+	if (strcasecmp(arg, "on" ) == 0) return 1;
+	return 0;
+}
+
+static void mpd_pause(int mode);
+static void mpd_pause(int mode)
+{
+	struct empcd_status	st;
+
+	/* Every MPD toggles on a pause without a mode */
+	if (mode < 0 && !mirror.valid && mpd)
+	{
+		MPD_CMD(mpd_sendTogglePauseCommand(mpd));
+		return;
+	}
+
+	if (mode < 0)
+	{
+		/* Toggle the pause mode */
+		if (!status_get(&st)) return;
+
+		mode = (st.state == MPD_STATUS_STATE_PAUSE ? 0 : 1);
+	}
+
+	MPD_CMD(mpd_sendPauseCommand(mpd, mode));
+
+	if (MPD_OK() && mirror.valid && mirror.state != MPD_STATUS_STATE_STOP)
+	{
+		mirror.state = mode ? MPD_STATUS_STATE_PAUSE : MPD_STATUS_STATE_PLAY;
+	}
+}
+
+static void f_pause(const char *arg, const char UNUSED *args);
+static void f_pause(const char *arg, const char UNUSED *args)
+{
+	mpd_pause(parse_mode(arg));
+}
+
+/* Toggles depend on the status, which a command list itself might change */
+static char *r_pause(const char *arg, unsigned int *deadline);
+static char *r_pause(const char *arg, unsigned int *deadline)
+{
+	*deadline = EMPCD_DEADLINE_CMD;
+
+	if (!arg) return NULL;
+	if (strcasecmp(arg, "on") == 0) return mpd_renderCommand("pause", "1");
+	if (strcasecmp(arg, "off") == 0) return mpd_renderCommand("pause", "0");
+	return NULL;
+}
+
+static void mpd_random(int mode);
+static void mpd_random(int mode)
+{
+	struct empcd_status	st;
+
+	if (mode < 0)
+	{
+		/* Toggle the random mode */
+		if (!status_get(&st)) return;
+
+		mode = !st.random;
+	}
+
+	MPD_CMD(mpd_sendRandomCommand(mpd, mode));
+
+	if (MPD_OK()) mirror.random = mode;
+}
+
+static void f_random(const char *arg, const char UNUSED *args);
+static void f_random(const char *arg, const char UNUSED *args)
+{
+	mpd_random(parse_mode(arg));
+}
+
+/* Toggles depend on the status, which a command list itself might change */
+static char *r_random(const char *arg, unsigned int *deadline);
+static char *r_random(const char *arg, unsigned int *deadline)
+{
+	*deadline = EMPCD_DEADLINE_CMD;
+
+	if (!arg) return NULL;
+	if (strcasecmp(arg, "on") == 0) return mpd_renderCommand("random", "1");
+	if (strcasecmp(arg, "off") == 0) return mpd_renderCommand("random", "0");
+	return NULL;
+}
+
+static void f_update(const char *arg, const char UNUSED *args);
+static void f_update(const char *arg, const char UNUSED *args)
+{
+	char *path;
+
+	path = (char *)(arg == NULL ? "" : arg);
+
+	MPD_CMDD(EMPCD_DEADLINE_SLOW, mpd_sendUpdateCommand(mpd, path));
+}
+
+static char *r_update(const char *arg, unsigned int *deadline);
+static char *r_update(const char *arg, unsigned int *deadline)
+{
+	*deadline = EMPCD_DEADLINE_SLOW;
+	return mpd_renderCommand("update", arg == NULL ? "" : arg);
+}
+
+static const struct empcd_funcs
+{
+	void		(*function)(const char *arg, const char *args);
+	char		*(*render)(const char *arg, unsigned int *deadline);	/* The protocol line, NULL when it depends on the status */
+	bool		raw;				/* A single run sends the rendered line, else function keeps the mirror in step */
+	bool		requires_mpd;
+	enum empcd_offline_policy offline;		/* While MPD is unreachable */
+	const char	*name;
+	const char	*args;
+	const char	*desc;
+} func_map[] =
+{
+	/* empcd builtin commands */
+	{ f_exec,	NULL,		false,	false,	EMPCD_OFFLINE_DROP,	"exec",			"<shellcmd>",		"Execute a command"							},
+	{ f_coproc,	NULL,		false,	false,	EMPCD_OFFLINE_DROP,	"coproc",		"<name> <line>",	"Write a line to the stdin of a coproc"					},
+	{ f_quit,	NULL,		false,	false,	EMPCD_OFFLINE_DROP,	"quit",			NULL,			"Quit empcd"								},
+
+	/* MPD specific commands */
+	{ f_next,	r_next,		true,	true,	EMPCD_OFFLINE_DROP,	"mpd_next",		NULL,			"MPD Next Track"							},
+	{ f_prev,	r_prev,		true,	true,	EMPCD_OFFLINE_DROP,	"mpd_prev",		NULL,			"MPD Previous Track"							},
+	{ f_stop,	r_stop,		true,	true,	EMPCD_OFFLINE_LAST,	"mpd_stop",		NULL,			"MPD Stop Playing"							},
+	{ f_play,	r_play,		true,	true,	EMPCD_OFFLINE_LAST,	"mpd_play",		NULL,			"MPD Start Playing"							},
+	{ f_pause,	r_pause,	false,	true,	EMPCD_OFFLINE_LAST,	"mpd_pause",		"[toggle|on|off]",	"MPD Pause Toggle or Set"						},
+	{ f_seek,	NULL,		false,	true,	EMPCD_OFFLINE_DROP,	"mpd_seek",		"[+|-]<val>[%]",	"MPD Seek direct or relative (+|-) percentage when ends in %"		},
+	{ f_volume,	r_volume,	false,	true,	EMPCD_OFFLINE_LAST,	"mpd_volume",		"[+|-]<val>[%]",	"MPD Volume direct or relative (+|-) percentage when ends in %"		},
+	{ f_random,	r_random,	false,	true,	EMPCD_OFFLINE_LAST,	"mpd_random",		"[toggle|on|off]",	"MPD Random Toggle or Set"						},
+	{ f_update,	r_update,	true,	true,	EMPCD_OFFLINE_LAST,	"mpd_update",		"[<path>]",		"MPD Update"								},
+	{ f_load,	r_load,		true,	true,	EMPCD_OFFLINE_KEEP,	"mpd_plst_load",	"<playlist>",		"MPD Load Playlist"							},
+	{ f_save,	r_save,		true,	true,	EMPCD_OFFLINE_KEEP,	"mpd_plst_save",	"<playlist>",		"MPD Save Playlist"							},
+	{ f_clear,	r_clear,	true,	true,	EMPCD_OFFLINE_KEEP,	"mpd_plst_clear",	NULL,			"MPD Clear Playlist"							},
+	{ f_remove,	r_remove,	true,	true,	EMPCD_OFFLINE_KEEP,	"mpd_plst_remove",	"<playlist>",		"MPD Remove Playlist"							},
+	{ f_raw,	r_raw,		true,	true,	EMPCD_OFFLINE_KEEP,	"mpd_raw",		"<command>",		"MPD Send a protocol command as is"					},
+
+	/* End */
+	{ NULL,		NULL,		false,	false,	EMPCD_OFFLINE_DROP,	NULL,			NULL,			"undefined"								}
+};
+
+/********************************************************************/
+
+static unsigned int keymap_hash(uint16_t type, uint16_t code, int32_t value);
+static unsigned int keymap_hash(uint16_t type, uint16_t code, int32_t value)
+{
+	uint32_t h;
+
+	/* Multiplicative hashing, the keys are tiny so this is plenty */
+	h = (((uint32_t)type << 16) | code) * 2654435761U;
+	h ^= ((uint32_t)value) * 0x85ebca6bU;
+	h ^= h >> 15;
+
+	return h;
+}
+
+static struct empcd_keymap *keymap_new(void);
+static struct empcd_keymap *keymap_new(void)
+{
+	struct empcd_keymap *km;
+
+	km = calloc(1, sizeof(*km));
+	if (!km) return NULL;
+
+	km->events_size = EMPCD_KEYMAP_SIZE;
+	km->states_size = EMPCD_KEYMAP_SIZE;
+	km->events = calloc(km->events_size, sizeof(km->events[0]));
+	km->states = calloc(km->states_size, sizeof(km->states[0]));
+
+	if (!km->events || !km->states)
+	{
+		free(km->events);
+		free(km->states);
+		free(km);
+		return NULL;
+	}
+
+	return km;
+}
+
+static void keymap_free(struct empcd_keymap *km);
+static void keymap_free(struct empcd_keymap *km)
+{
+	struct empcd_events	*evt, *evt_next;
+	struct empcd_keystate	*st, *st_next;
+	unsigned int		i;
+
+	if (!km) return;
+
+	for (i = 0; i < km->events_size; i++)
+	{
+		for (evt = km->events[i]; evt; evt = evt_next)
+		{
+			evt_next = evt->next;
+			free((char *)evt->args);
+			free(evt->cmd);
+			free(evt->argv);
+			free(evt->line);
+			free(evt);
+		}
+	}
+
+	for (i = 0; i < km->states_size; i++)
+	{
+		for (st = km->states[i]; st; st = st_next)
+		{
+			st_next = st->next;
+			free(st);
+		}
+	}
+
+	free(km->events);
+	free(km->states);
+	free(km);
+}
+
+/* Append to the tail of the bucket so that mappings keep their configuration order */
+static void keymap_link(struct empcd_events **bucket, struct empcd_events *evt);
+static void keymap_link(struct empcd_events **bucket, struct empcd_events *evt)
+{
+	while (*bucket) bucket = &(*bucket)->next;
+	evt->next = NULL;
+	*bucket = evt;
+}
+
+static bool keymap_grow(struct empcd_keymap *km);
+static bool keymap_grow(struct empcd_keymap *km)
+{
+	struct empcd_events	**events, *evt, *evt_next;
+	struct empcd_keystate	**states, *st, *st_next;
+	unsigned int		i, size, h;
+
+	if (km->events_count >= km->events_size)
+	{
+		size = km->events_size * 2;
+		events = calloc(size, sizeof(events[0]));
+		if (!events) return false;
+
+		for (i = 0; i < km->events_size; i++)
+		{
+			for (evt = km->events[i]; evt; evt = evt_next)
+			{
+				evt_next = evt->next;
+				h = keymap_hash(evt->type, evt->code, evt->value) & (size - 1);
+				keymap_link(&events[h], evt);
+			}
+		}
+
+		free(km->events);
+		km->events = events;
+		km->events_size = size;
+	}
+
+	if (km->states_count >= km->states_size)
+	{
+		size = km->states_size * 2;
+		states = calloc(size, sizeof(states[0]));
+		if (!states) return false;
+
+		for (i = 0; i < km->states_size; i++)
+		{
+			for (st = km->states[i]; st; st = st_next)
+			{
+				st_next = st->next;
+				h = keymap_hash(st->type, st->code, 0) & (size - 1);
+				st->next = states[h];
+				states[h] = st;
+			}
+		}
+
+		free(km->states);
+		km->states = states;
+		km->states_size = size;
+	}
+
+	return true;
+}
+
+static struct empcd_keystate *keymap_state(struct empcd_keymap *km, uint16_t type, uint16_t code, bool create);
+static struct empcd_keystate *keymap_state(struct empcd_keymap *km, uint16_t type, uint16_t code, bool create)
+{
+	struct empcd_keystate	*st;
+	unsigned int		h;
+
+	h = keymap_hash(type, code, 0) & (km->states_size - 1);
+
+	for (st = km->states[h]; st; st = st->next)
+	{
+		if (st->type == type && st->code == code) return st;
+	}
+
+	if (!create) return NULL;
+
+	st = calloc(1, sizeof(*st));
+	if (!st) return NULL;
+
+	st->type = type;
+	st->code = code;
+	st->value = -1;
+	st->next = km->states[h];
+	km->states[h] = st;
+	km->states_count++;
+
+	return st;
+}
+
+/*
+ * Reloading (SIGHUP)
+ * The input thread swaps in the new keymap between frames and hands the
+ * old one to the executor. That frees it once nothing refers to it anymore:
+ * every action queued before the swap is done and none is kept offline.
+ */
+static bool keymap_owns(const struct empcd_keymap *km, const struct empcd_events *evt);
+static bool keymap_owns(const struct empcd_keymap *km, const struct empcd_events *evt)
+{
+	const struct empcd_events *e;
+
+	for (	e = km->events[keymap_hash(evt->type, evt->code, evt->value) & (km->events_size - 1)];
+		e && e != evt;
+		e = e->next);
+
+	return e != NULL;
+}
+
+/* Input thread, right after the swap */
+static void keymap_retire(struct empcd_keymap *km);
+static void keymap_retire(struct empcd_keymap *km)
+{
+	km->head = queue.head;
+	km->next = __atomic_load_n(&retiring, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&retiring, &km->next, km, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Executor, after a drain; all at shutdown once it stopped */
+static void keymap_reap(bool all);
+static void keymap_reap(bool all)
+{
+	struct empcd_keymap	*km, *next, **kp;
+	unsigned int		i;
+	bool			used;
+
+	for (km = __atomic_exchange_n(&retiring, NULL, __ATOMIC_ACQUIRE); km; km = next)
+	{
+		next = km->next;
+		km->next = retired;
+		retired = km;
+	}
+
+	for (kp = &retired; (km = *kp) != NULL; )
+	{
+		/* Still queued or kept for when MPD is back? */
+		used = (int)(queue.tail - km->head) < 0;
+		for (i = 0; !used && i < offline.count; i++) used = keymap_owns(km, offline.list[i].evt);
+
+		if (used && !all)
+		{
+			kp = &km->next;
+			continue;
+		}
+
+		/* Children only compare the pointer, for their limit */
+		for (i = 0; i < children.count; i++)
+		{
+			if (children.list[i].evt && keymap_owns(km, children.list[i].evt)) children.list[i].evt = NULL;
+		}
+
+		*kp = km->next;
+		keymap_free(km);
+		dolog(LOG_DEBUG, "Freed the keymap replaced by a reload\n");
+	}
+}
+
+/* Can the action be sent as is, without looking at the status first? */
+static bool evt_sendable(const struct empcd_events *evt);
+static bool evt_sendable(const struct empcd_events *evt)
+{
+	return evt->cmd != NULL;
+}
+
+/* Execute the action, a single send of the rendered line when there is one */
+static void evt_run(const struct empcd_events *evt);
+static void evt_run(const struct empcd_events *evt)
+{
+	if (evt->action == f_exec && evt->args && evt->args[0] != '\0')
+	{
+		exec_spawn(evt, evt->args);
+		return;
+	}
+
+	if (evt->coproc)
+	{
+		coproc_write(evt->coproc, evt->line, evt->linelen);
+		return;
+	}
+
+	if (!evt->raw || nompd)
+	{
+		evt->action(evt->args, evt->needargs);
+		return;
+	}
+
+	MPD_CMDD(evt->deadline, mpd_sendRawCommand(mpd, evt->cmd, evt->cmdlen));
+}
+
+/* coproc <name> <line>: find the helper and prepare the line */
+static bool coproc_event(struct empcd_events *evt);
+static bool coproc_event(struct empcd_events *evt)
+{
+	const char *line = evt->args ? strchr(evt->args, ' ') : NULL;
+
+	if (!line)
+	{
+		dolog(LOG_ERR, "coproc requires a name and a line\n");
+	}
+	else if (!(evt->coproc = coproc_find(evt->args, line - evt->args)))
+	{
+		dolog(LOG_ERR, "Unknown coproc '%.*s', define it with coproc first\n", (int)(line - evt->args), evt->args);
+	}
+	else if (strlen(line) >= PIPE_BUF)
+	{
+		dolog(LOG_ERR, "coproc line is longer than %u bytes\n", PIPE_BUF - 1);
+	}
+	else if (!(evt->line = malloc(strlen(line))))
+	{
+		dolog(LOG_ERR, "Out of memory while adding an event\n");
+	}
+	else
+	{
+		/* The newline takes the place of the space */
+		evt->linelen = strlen(line);
+		memcpy(evt->line, line + 1, evt->linelen - 1);
+		evt->line[evt->linelen - 1] = '\n';
+		return true;
+	}
+
+	free((char *)evt->args);
+	free(evt);
+	return false;
+}
+
+static bool set_event(struct empcd_keymap *km, uint16_t type, uint16_t code, int32_t value, const struct empcd_funcs *func, const char *args, struct empcd_group *group);
+static bool set_event(struct empcd_keymap *km, uint16_t type, uint16_t code, int32_t value, const struct empcd_funcs *func, const char *args, struct empcd_group *group)
+{
+	struct empcd_events	*evt;
+	bool			norepeat = false;
+
+	if (!keymap_grow(km))
+	{
+		dolog(LOG_ERR, "Out of memory while growing the event table\n");
+		return false;
+	}
+
+	/* Handle no-repeating 'up' key */
+	if (type == EV_KEY && value == EMPCD_KEY_UPNR)
+	{
+		value = EV_KEY_UP;
+		norepeat = true;
+	}
+
+	evt = calloc(1, sizeof(*evt));
+	if (!evt)
+	{
+		dolog(LOG_ERR, "Out of memory while adding an event\n");
+		return false;
+	}
+
+	evt->state = keymap_state(km, type, code, true);
+	if (!evt->state)
+	{
+		free(evt);
+		dolog(LOG_ERR, "Out of memory while adding an event\n");
+		return false;
+	}
+
+	evt->type = type;
+	evt->code = code;
+	evt->value = value;
+	evt->norepeat = norepeat;
+	evt->action = func->function;
+	evt->requires_mpd = func->requires_mpd;
+	evt->offline = func->offline;
+	evt->args = args ? strdup(args) : args;
+	evt->needargs = func->args;
+	evt->group = group;
+
+	if (func->function == f_exec)
+	{
+		evt->argv = args ? exec_split(args) : NULL;
+		evt->limit = exec_limit;
+	}
+
+	if (func->function == f_coproc && !coproc_event(evt)) return false;
+
+	if (func->render)
+	{
+		evt->cmd = func->render(evt->args, &evt->deadline);
+		if (evt->cmd)
+		{
+			evt->cmdlen = strlen(evt->cmd);
+			evt->raw = func->raw;
+		}
+	}
+
+	/* A group gets the command as is, there is no status to look at */
+	if (group && !evt_sendable(evt))
+	{
+		dolog(LOG_ERR, "%s %s can't be sent to MPD group %s, it needs the status of a single MPD\n",
+			func->name, args ? args : "", group->name);
+		free((char *)evt->args);
+		free(evt->argv);
+		free(evt->cmd);
+		free(evt->line);
+		free(evt);
+		return false;
+	}
+
+	keymap_link(&km->events[keymap_hash(type, code, value) & (km->events_size - 1)], evt);
+	km->events_count++;
+
+	return true;
+}
+
+/* [@<group>] <function> [<arg>] */
+static bool which_func(const char *buf, unsigned int len, unsigned int *o_, unsigned int *func_, const char **arg, struct empcd_group **group);
+static bool which_func(const char *buf, unsigned int len, unsigned int *o_, unsigned int *func_, const char **arg, struct empcd_group **group)
+{
+	unsigned int i, o = *o_, l;
+
+	*group = NULL;
+	if (o < len && buf[o] == '@')
+	{
+		for (l = o + 1; l < len && buf[l] != ' '; l++);
+
+		*group = group_find(&buf[o + 1], l - o - 1);
+		if (!*group)
+		{
+			dolog(LOG_ERR, "Unknown MPD group '%.*s', define it with mpd_group first\n", (int)(l - o - 1), &buf[o + 1]);
+			*o_ = o;
+			return false;
+		}
+
+		o = l + 1;
+	}
+
+	/* Figure out the function */
+	for (i=0; func_map[i].name != NULL; i++)
+	{
+		l = strlen(func_map[i].name);
+		if (len != o+l && (len < o+l || buf[o+l] != ' ')) continue;
+		if (strncasecmp(&buf[o], func_map[i].name, l) == 0) break;
+	}
+
+	if (func_map[i].name == NULL)
+	{
+		*o_ = o;
+		return false;
+	}
+	*func_ = i;
+
+	o += l+1;
+	if (len > o) *arg = &buf[o];
+	else *arg = NULL;
+
+	*o_ = o;
+
+	return true;
+}
+
+/*
+	KEY_KPSLASH DOWN f_seek -1
+	<key> <value> <action> <arg>
+*/
+static bool set_event_from_map(struct empcd_keymap *km, const char *buf, struct empcd_mapping *event_map, struct empcd_mapping *value_map);
+static bool set_event_from_map(struct empcd_keymap *km, const char *buf, struct empcd_mapping *event_map, struct empcd_mapping *value_map)
+{
+	unsigned int	i = 0, o = 0, len = strlen(buf), l = 0,
+			event_code = 0,
+			value = 0, func = 0;
+	const char	*arg = NULL;
+	const char	*event_name = "custom", *event_desc = "custom";
+	struct empcd_group *group;
+
+	/* Not a numeric value? */
+	if (sscanf(&buf[o], "%u", &i) == 1 && i == 0)
+	{
+		/* This is our event_code */
+		event_code = i;
+	}
+	else
+	{
+		/* Try a name match */
+		for (i=0; event_map[i].code != EMPCD_MAPPING_END; i++)
+		{
+			l = strlen(event_map[i].name);
+			if (len < o+l || buf[o+l] != ' ') continue;
+			if (strncasecmp(&buf[o], event_map[i].name, l) == 0) break;
+		}
+
+		if (event_map[i].code == EMPCD_MAPPING_END)
+		{
+			dolog(LOG_DEBUG, "Undefined Code at %u in '%s'\n", o, buf);
+			return false;
+		}
+
+		/* This is our event_code */
+		event_code = event_map[i].code;
+		event_name = event_map[i].name;
+		event_desc = event_map[i].desc;
+	}
+
+	/* Figure out the value (up/down/release/...) */
+	o += l+1;
+	for (i=0; value_map[i].code != EMPCD_MAPPING_END; i++)
+	{
+		l = strlen(value_map[i].name);
+		if (len < o+l || buf[o+l] != ' ') continue;
+		if (strncasecmp(&buf[o], value_map[i].name, l) == 0) break;
+	}
+
+	if (value_map[i].code == EMPCD_MAPPING_END)
+	{
+		dolog(LOG_DEBUG, "Undefined Key Value at %u in '%s'\n", o, buf);
+		return false;
+	}
+	value = i;
+
+	o += l+1;
+
+	/* Figure out the function */
+	if (!which_func(buf, len, &o, &i, &arg, &group))
+	{
+		dolog(LOG_DEBUG, "Undefined Function at %u in '%s'\n", o, buf);
+		return false;
+	}
+	func = i;
+
+	dolog(LOG_DEBUG, "Mapping Event %s (%s/%u) %s (%s) to do %s (%s) with arg %s on %s\n",
+		event_name, event_desc, event_code,
+		value_map[value].name, value_map[value].desc,
+		func_map[func].name, func_map[func].desc,
+		arg ? arg : "<none>", group ? group->name : "mpd_host");
+
+	if (func_map[func].requires_mpd && nompd)
+	{
+		dolog(LOG_ERR, "Function requires MPD but MPD is disabled\n");
+		return false;
+	}
+
+	return set_event(km, EV_KEY, event_code, value_map[value].code, &func_map[func], arg, group);
+}
+
+static bool set_event_from_custom(struct empcd_keymap *km, char *buf);
+static bool set_event_from_custom(struct empcd_keymap *km, char *buf)
+{
+	unsigned int	type, code, value;
+	unsigned int	o, c = 0, func;
+	const char	*arg;
+	struct empcd_group *group;
+
+	dolog(LOG_ERR, "Custom Event: '%s'\n", buf);
+
+	if (sscanf(buf, "%u %u %u ", &type, &code, &value) != 3)
+	{
+		dolog(LOG_ERR, "'custom' requires a numeric type, code and value\n");
+		return false;
+	}
+
+	/* Check if they are max 16 bits (value is 32bits) */
+	if (type > 0xffff || code > 0xffff)
+	{
+		dolog(LOG_ERR, "'custom' type/code/value are only 16bits, value provided too large\n");
+		return false;
+	}
+
+	/* Skip over the type/code/value */
+	for (o = 0; c < 3 && buf[o] != '\0'; o++)
+	{
+		if (buf[o] == ' ') c++;
+	}
+
+	if (c != 3 || buf[o] == '\0')
+	{
+		dolog(LOG_ERR, "'custom' requires a numeric type, code and value plus a function and optional arguments\n");
+		return false;
+	}
+
+	if (!which_func(buf, strlen(buf), &o, &func, &arg, &group)) return false;
+
+	dolog(LOG_DEBUG,
+		"Mapping Custom Event (type %u, code %u, value %u) to do %s (%s) with arg %s\n",
+		type, code, value,
+		func_map[func].name, func_map[func].desc,
+		arg ? arg : "<none>");
+
+	if (func_map[func].requires_mpd && nompd)
+	{
+		dolog(LOG_ERR, "Function requires MPD but MPD is disabled\n");
+		return false;
+	}
+
+	return set_event(km, type, code, value, &func_map[func], arg, group);
+}
+
+/********************************************************************/
+
+static struct empcd_device *device_add(const char *path, struct empcd_keymap *km);
+static struct empcd_device *device_add(const char *path, struct empcd_keymap *km)
+{
+	struct empcd_device *dev, **dp;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev || !(dev->path = strdup(path)))
+	{
+		free(dev);
+		dolog(LOG_ERR, "Out of memory while adding event device %s\n", path);
+		return NULL;
+	}
+
+	dev->fd = -1;
+	dev->watch.fd = -1;
+	dev->hotplug.fd = -1;
+	dev->exclusive = exclusive;
+	dev->keymap = km;
+
+	for (dp = &devices; *dp; dp = &(*dp)->next);
+	*dp = dev;
+
+	return dev;
+}
+
+/*
+ * eventdevice <path|name:|id:|phys:> starts the section of a device,
+ * the mappings before the first one are for the first device.
+ * A reload fills pending of the devices there are, in the same order.
+ */
+static bool device_section(const char *path, bool reload, struct empcd_device **dev, struct empcd_keymap **cur, struct empcd_keymap *km);
+static bool device_section(const char *path, bool reload, struct empcd_device **dev, struct empcd_keymap **cur, struct empcd_keymap *km)
+{
+	struct empcd_keymap *next = *dev ? keymap_new() : km;
+
+	if (!next)
+	{
+		dolog(LOG_ERR, "Out of memory while adding event device %s\n", path);
+		return false;
+	}
+
+	if (!reload) *dev = device_add(path, next);
+	else
+	{
+		*dev = *dev ? (*dev)->next : devices;
+		if (!*dev || strcmp((*dev)->path, path) != 0)
+		{
+			dolog(LOG_ERR, "Changing the eventdevice lines needs a restart\n");
+			*dev = NULL;
+		}
+		else (*dev)->pending = next;
+	}
+
+	if (!*dev)
+	{
+		if (next != km) keymap_free(next);
+		return false;
+	}
+
+	*cur = next;
+	return true;
+}
+
+/* For dev, or the default of the devices that follow */
+static void device_exclusive(struct empcd_device *dev, bool on);
+static void device_exclusive(struct empcd_device *dev, bool on)
+{
+	if (dev) dev->exclusive = on;
+	else exclusive = on;
+}
+
+/*
+	 0 = failed to open file
+	>0 = all okay (lines read)
+	<0 = error parsing file (line number)
+
+	km gets the mappings before the first eventdevice.
+	A reload only reads the mappings, into pending of the devices.
+*/
+static int readconfig(const char *cfgfile, bool reload, struct empcd_keymap *km);
+static int readconfig(const char *cfgfile, bool reload, struct empcd_keymap *km)
+{
+	struct empcd_device	*dev = NULL;
+	struct empcd_keymap	*cur = km;
+	unsigned int	line = 0;
+	int		ret = 0;
+	FILE		*f;
+
+	f = fopen(cfgfile, "r");
+
+	dolog(LOG_DEBUG, "ReadConfig(%s) = %s\n", cfgfile, f ? "ok" : "error");
+
+	if (!f) return 0;
+
+	while (!feof(f) && ret == 0)
+	{
+		char buf[1024], buf2[1024];
+		unsigned int n, i = 0, j = 0;
+
+		line++;
+
+		if (fgets(buf2, sizeof(buf2), f) == 0) break;
+		n = strlen(buf2)-1;
+
+		/*
+		 * Trim whitespace
+		 * - Translate \t to space
+		 * - strip multiple whitespaces
+		 * Saves handling them below
+		 */
+		for (i=0,j=0; i<n; i++)
+		{
+			if (buf2[i] == '\t') buf2[i] = ' ';
+			if (	(i == 0 || (i > 0 && buf2[i-1] == ' ')) &&
+				(buf2[i] == ' ' || buf2[i] == '\t'))
+			{
+				continue;
+			}
+
+			buf[j++] = buf2[i];
+		}
+
+		/* Trim trailing space if it is there */
+		if (j>0 && buf[j-1] == ' ') j--;
+
+		/* Terminate our new constructed string */
+		buf[j] = '\0';
+		n = j;
+
+		/* Empty or comment line? */
+		if (	n == 0 ||
+			buf[0] == '#' ||
+			(buf[0] == '/' && buf[1] == '/'))
+		{
+			continue;
+		}
+
+		dolog(LOG_DEBUG, "%s@%04u: %s\n", cfgfile, line, buf);
+
+		/* A reload only replaces the mappings, the rest needs a restart */
+		if (	reload &&
+			strncasecmp("eventdevice ", buf, 12) != 0 &&
+			strncasecmp("key ", buf, 4) != 0 &&
+			strncasecmp("custom ", buf, 7) != 0 &&
+			strncasecmp("exec_limit ", buf, 11) != 0)
+		{
+			continue;
+		}
+
+		if (strncasecmp("mpd_host ", buf, 9) == 0)
+		{
+			dolog(LOG_DEBUG, "Setting MPD_HOST to %s\n", &buf[9]);
+			if (mpd_host) free(mpd_host);
+			mpd_host = strdup(&buf[9]);
+		}
+		else if (strncasecmp("mpd_port ", buf, 9) == 0)
+		{
+			dolog(LOG_DEBUG, "Setting MPD_PORT to %s\n", &buf[9]);
+			if (mpd_port) free(mpd_port);
+			mpd_port = strdup(&buf[9]);
+		}
+		else if (strncasecmp("mpd_standby ", buf, 12) == 0)
+		{
+			if (!standby_add(&buf[12]))
+			{
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("mpd_group ", buf, 10) == 0)
+		{
+			if (!group_add(&buf[10]))
+			{
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("coproc ", buf, 7) == 0)
+		{
+			if (!coproc_add(&buf[7]))
+			{
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("exec_limit ", buf, 11) == 0)
+		{
+			/* For the exec mappings that follow */
+			exec_limit = atoi(&buf[11]);
+		}
+		else if (strncasecmp("eventdevice ", buf, 12) == 0)
+		{
+			if (!device_section(&buf[12], reload, &dev, &cur, km))
+			{
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("exclusive ", buf, 10) == 0)
+		{
+			/* Within a device section only for that device */
+			if (strncasecmp("on", &buf[10], 2) == 0) device_exclusive(dev, true);
+			else if (strncasecmp("off", &buf[10], 3) == 0) device_exclusive(dev, false);
+			else
+			{
+				dolog(LOG_ERR, "Exclusive is either 'on' or 'off'\n");
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("exclusive", buf, 9) == 0)
+		{
+			device_exclusive(dev, true);
+		}
+		else if (strncasecmp("nonexclusive", buf, 12) == 0)
+		{
+			device_exclusive(dev, false);
+		}
+		else if (strncasecmp("dedup_window ", buf, 13) == 0)
+		{
+			dedup_window = atoi(&buf[13]);
+		}
+		else if (strncasecmp("key ", buf, 4) == 0)
+		{
+			if (!set_event_from_map(cur, &buf[4], key_event_map, key_value_map))
+			{
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("custom ", buf, 7) == 0)
+		{
+			if (!set_event_from_custom(cur, &buf[7]))
+			{
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("user ", buf, 5) == 0)
+		{
+			struct passwd *passwd;
+
+			/* setuid()+setgid() to another user+group */
+			passwd = getpwnam(&buf[5]);
+			if (passwd)
+			{
+				drop_uid = passwd->pw_uid;
+				drop_gid = passwd->pw_gid;
+			}
+			else
+			{
+				dolog(LOG_ERR, "Couldn't find user %s\n", optarg);
+				ret = -line;
+				break;
+			}
+		}
+		else if (strncasecmp("giveup", buf, 6) == 0)
+		{
+			giveup = true;
+		}
+		else if (strncasecmp("dontgiveup", buf, 10) == 0)
+		{
+			giveup = false;
+		}
+		else if (strncasecmp("nompd", buf, 5) == 0)
+		{
+			nompd = true;
+		}
+		else
+		{
+			dolog(LOG_ERR, "Unrecognized configuration line %u: %s\n", line, buf);
+			ret = -line;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret == 0 ? (int)line : ret;
+}
+
+/********************************************************************/
+
+static bool queue_init(struct empcd_queue *q);
+static bool queue_init(struct empcd_queue *q)
+{
+	memset(q, 0, sizeof(*q));
+
+	q->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->wake.fd < 0)
+	{
+		doelog(LOG_ERR, errno, "Couldn't create executor eventfd\n");
+		return false;
+	}
+
+	return true;
+}
+
+/* Producer side, called from the input path, never blocks */
+static bool queue_push(struct empcd_queue *q, const struct empcd_events *evt, uint32_t frame);
+static bool queue_push(struct empcd_queue *q, const struct empcd_events *evt, uint32_t frame)
+{
+	unsigned int head, depth;
+
+	head = q->head;
+	depth = head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (depth >= EMPCD_QUEUE_SIZE)
+	{
+		/* Executor is way behind, rather drop than stall the input */
+		q->dropped++;
+		dolog(LOG_DEBUG, "Action queue full, dropping action\n");
+		return false;
+	}
+
+	q->ring[head & (EMPCD_QUEUE_SIZE - 1)].evt = evt;
+	q->ring[head & (EMPCD_QUEUE_SIZE - 1)].frame = frame;
+	q->ring[head & (EMPCD_QUEUE_SIZE - 1)].attempts = 0;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	q->enqueued++;
+	if (depth + 1 > q->maxdepth) q->maxdepth = depth + 1;
+
+	return true;
+}
+
+static unsigned int queue_depth(struct empcd_queue *q);
+static unsigned int queue_depth(struct empcd_queue *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+#define QUEUE_EVT(q, i)		((q)->ring[(i) & (EMPCD_QUEUE_SIZE - 1)].evt)
+#define QUEUE_FRAME(q, i)	((q)->ring[(i) & (EMPCD_QUEUE_SIZE - 1)].frame)
+
+/* Can the action go out in a command list? Group actions go their own way */
+static bool queue_batchable(const struct empcd_events *evt);
+static bool queue_batchable(const struct empcd_events *evt)
+{
+	return !nompd && !evt->group && evt_sendable(evt);
+}
+
+/*
+ * Can the action be sent again when the connection broke while it was
+ * underway? Absolute values and explicit modes can, anything relative to
+ * what MPD did (next, +5, toggle) or that adds something (load) can't.
+ */
+static bool queue_idempotent(const struct empcd_events *evt);
+static bool queue_idempotent(const struct empcd_events *evt)
+{
+	struct empcd_adjust adj;
+
+	if (evt->action == f_seek || evt->action == f_volume)
+	{
+		return parse_adjust(evt->args, &adj) && !adj.relative;
+	}
+
+	if (evt->action == f_pause || evt->action == f_random)
+	{
+		return evt->args && (strcasecmp(evt->args, "on") == 0 || strcasecmp(evt->args, "off") == 0);
+	}
+
+	return evt->action == f_play || evt->action == f_stop || evt->action == f_clear;
+}
+
+/*
+ * Does the action change what the mirror idles on (player, mixer,
+ * options, playlist)? Stored playlists and the database are not
+ * reported to it, raw commands could be anything.
+ */
+static bool queue_mirrored(const struct empcd_events *evt);
+static bool queue_mirrored(const struct empcd_events *evt)
+{
+	return evt->action != f_update && evt->action != f_save && evt->action != f_remove;
+}
+
+static const char *queue_action_name(const struct empcd_events *evt);
+static const char *queue_action_name(const struct empcd_events *evt)
+{
+	unsigned int i;
+
+	for (i=0; func_map[i].name != NULL && func_map[i].function != evt->action; i++);
+	return func_map[i].name;
+}
+
+/*
+ * Send consecutive MPD actions from the same input frame as one
+ * command_list_ok_begin ... command_list_end, one round-trip in total.
+ * MPD stops at the first failing command, that one gets reported
+ * with its error, the ones after it as not executed.
+ * Returns the number of queue entries consumed, 0 when there was
+ * nothing to batch.
+ */
+static unsigned int queue_batch(struct empcd_queue *q, unsigned int tail, unsigned int head);
+static unsigned int queue_batch(struct empcd_queue *q, unsigned int tail, unsigned int head)
+{
+	const struct empcd_events	*evt;
+	uint32_t			frame = QUEUE_FRAME(q, tail);
+	unsigned int			i, n, failed;
+
+	if (!mpd) return 0;
+
+	for (n = 0; tail + n != head; n++)
+	{
+		if (	QUEUE_FRAME(q, tail + n) != frame ||
+			!queue_batchable(QUEUE_EVT(q, tail + n)))
+		{
+			break;
+		}
+	}
+
+	if (n < 2) return 0;
+
+	dolog(LOG_DEBUG, "Batching %u actions into one command list\n", n);
+
+	mpd_begin(EMPCD_DEADLINE_SLOW);
+
+	mpd_sendCommandListOkBegin(mpd);
+	for (i = 0; i < n; i++)
+	{
+		evt = QUEUE_EVT(q, tail + i);
+		mpd_sendRawCommand(mpd, evt->cmd, evt->cmdlen);
+	}
+	mpd_sendCommandListEnd(mpd);
+
+	if (!mpd_check())
+	{
+		while (mpd_nextListOkCommand(mpd) == 0);
+
+		if (mpd->error == MPD_ERROR_ACK)
+		{
+			failed = (mpd->errorAt >= 0 && (unsigned int)mpd->errorAt < n) ? (unsigned int)mpd->errorAt : 0;
+
+			for (i = failed; i < n; i++)
+			{
+				evt = QUEUE_EVT(q, tail + i);
+				if (i == failed)
+				{
+					dolog(LOG_WARNING, "%s(%s) failed: %s\n",
+						queue_action_name(evt), evt->args ? evt->args : "", mpd->errorStr);
+				}
+				else
+				{
+					dolog(LOG_WARNING, "%s(%s) not executed due to the previous error\n",
+						queue_action_name(evt), evt->args ? evt->args : "");
+				}
+			}
+
+			mpd_clearError(mpd);
+		}
+		else if (!mpd_check())
+		{
+			mpd_finishCommand(mpd);
+			mpd_check();
+		}
+	}
+
+	/* Still connected, thus MPD answered the whole list */
+	if (mpd) breaker_success();
+
+	/* Idle will tell what changed, but only for what it is waiting on */
+	for (i = 0; i < n; i++)
+	{
+		if (queue_mirrored(QUEUE_EVT(q, tail + i)))
+		{
+			mirror.valid = false;
+			break;
+		}
+	}
+
+	STAT_ADD(q->batched, n);
+	return n;
+}
+
+/*
+ * Execute the action at tail, merging it with directly following
+ * actions of the same kind: relative seeks/volume changes are summed,
+ * an absolute one overrides what came before it and a row of next/prev
+ * becomes a single jump. Only adjacent actions are merged so that the
+ * order in respect to other actions stays the same.
+ * Returns the number of queue entries consumed.
+ */
+static unsigned int queue_coalesce(struct empcd_queue *q, unsigned int tail, unsigned int head);
+static unsigned int queue_coalesce(struct empcd_queue *q, unsigned int tail, unsigned int head)
+{
+	const struct empcd_events	*evt = QUEUE_EVT(q, tail), *nxt;
+	struct empcd_adjust		adj, more;
+	unsigned int			n = 1;
+	int				skip;
+
+	if (	(evt->action == f_seek || evt->action == f_volume) &&
+		parse_adjust(evt->args, &adj))
+	{
+		for (; tail + n != head; n++)
+		{
+			nxt = QUEUE_EVT(q, tail + n);
+			if (	nxt->action != evt->action ||
+				nxt->group ||
+				!parse_adjust(nxt->args, &more) ||
+				!merge_adjust(&adj, &more))
+			{
+				break;
+			}
+		}
+
+		if (n > 1)
+		{
+			dolog(LOG_DEBUG, "Coalesced %u %s actions into %s%d%s\n",
+				n, evt->action == f_seek ? "seek" : "volume",
+				adj.relative && adj.val >= 0 ? "+" : "", adj.val, adj.perc ? "%" : "");
+
+			if (evt->action == f_seek) mpd_seek(&adj);
+			else mpd_volume(&adj);
+
+			STAT_ADD(q->coalesced, n - 1);
+			return n;
+		}
+	}
+	else if (evt->action == f_next || evt->action == f_prev)
+	{
+		skip = (evt->action == f_next) ? 1 : -1;
+
+		/*
+		 * Only a run in one direction, a prev after running
+		 * off the end or a next after a prev clamped at the
+		 * start would not cancel out
+		 */
+		for (; tail + n != head; n++)
+		{
+			nxt = QUEUE_EVT(q, tail + n);
+			if (nxt->group || nxt->action != evt->action) break;
+			skip += (evt->action == f_next) ? 1 : -1;
+		}
+
+		if (n > 1)
+		{
+			dolog(LOG_DEBUG, "Coalesced %u next/prev actions into a skip of %d\n", n, skip);
+
+			if (mpd_skip(skip))
+			{
+				STAT_ADD(q->coalesced, n - 1);
+				return n;
+			}
+
+			/* Not playing, execute them one by one after all */
+			n = 1;
+		}
+	}
+
+	n = queue_batch(q, tail, head);
+	if (n > 0) return n;
+
+	evt_run(evt);
+	return 1;
+}
+
+/*
+ * Send the action to every member of its group: first the command to
+ * all of them, then collect all answers. The members work on it at the
+ * same time, thus the slowest one sets the pace instead of the sum.
+ */
+static void group_send(const struct empcd_events *evt);
+static void group_send(const struct empcd_events *evt)
+{
+	struct empcd_group	*g = evt->group;
+	struct empcd_link	*m;
+	unsigned int		i;
+
+	for (i = 0; i < g->count; i++)
+	{
+		m = &g->members[i].link;
+
+		if (m->state != EMPCD_LINK_READY)
+		{
+			if (m->state == EMPCD_LINK_DOWN) link_start(m);
+
+			dolog(LOG_INFO, "MPD %s member %s not connected, %s(%s) not sent to it\n",
+				g->name, m->server->where, queue_action_name(evt), evt->args ? evt->args : "");
+			STAT_ADD(g->failed, 1);
+			continue;
+		}
+
+		mpd_setDeadline(m->conn, evt->deadline ? evt->deadline : EMPCD_DEADLINE_CMD);
+		if (m->conn->idle) mpd_sendNoIdleCommand(m->conn);
+
+		mpd_sendRawCommand(m->conn, evt->cmd, evt->cmdlen);
+
+		if (m->conn->error)
+		{
+			link_backoff(m, m->conn->errorStr);
+			STAT_ADD(g->failed, 1);
+		}
+	}
+
+	for (i = 0; i < g->count; i++)
+	{
+		m = &g->members[i].link;
+		if (m->state != EMPCD_LINK_READY) continue;
+
+		mpd_finishCommand(m->conn);
+
+		if (m->conn->error == MPD_ERROR_ACK)
+		{
+			dolog(LOG_WARNING, "MPD %s member %s: %s(%s) failed: %s\n",
+				g->name, m->server->where, queue_action_name(evt), evt->args ? evt->args : "", m->conn->errorStr);
+			mpd_clearError(m->conn);
+			STAT_ADD(g->failed, 1);
+		}
+		else if (m->conn->error)
+		{
+			link_backoff(m, m->conn->errorStr);
+			STAT_ADD(g->failed, 1);
+			continue;
+		}
+
+		mpd_park(m->conn);
+	}
+
+	STAT_ADD(g->sent, 1);
+}
+
+/********************************************************************/
+
+static void offline_remove(unsigned int i);
+static void offline_remove(unsigned int i)
+{
+	offline.count--;
+	memmove(&offline.list[i], &offline.list[i + 1], (offline.count - i) * sizeof(offline.list[0]));
+	STAT_ADD(offline.compacted, 1);
+}
+
+/*
+ * Keep an MPD action for when MPD is back, according to its policy.
+ * LAST actions replace the previous one of the same kind, volume
+ * changes and toggles are folded into it, thus only the end state
+ * gets replayed. The replacement goes to the end to keep the order.
+ */
+static void offline_add(const struct empcd_events *evt, const char *why);
+static void offline_add(const struct empcd_events *evt, const char *why)
+{
+	struct empcd_offline_action	*o;
+	struct empcd_adjust		adj, merged;
+	int				mode = 0;
+	unsigned int			i;
+
+	memset(&adj, 0, sizeof(adj));
+
+	if (evt->offline == EMPCD_OFFLINE_DROP)
+	{
+		dolog(LOG_INFO, "%s, dropping %s(%s)\n", why,
+			queue_action_name(evt), evt->args ? evt->args : "");
+		STAT_ADD(queue.offline, 1);
+		return;
+	}
+
+	if (evt->action == f_volume && !parse_adjust(evt->args, &adj))
+	{
+		/* f_volume complains about it when it gets executed */
+		return;
+	}
+
+	if (evt->action == f_pause || evt->action == f_random) mode = parse_mode(evt->args);
+
+	for (i = offline.count; evt->offline == EMPCD_OFFLINE_LAST && i-- > 0;)
+	{
+		o = &offline.list[i];
+		if (o->evt->action != evt->action) continue;
+
+		if (evt->action == f_volume)
+		{
+			/* Percentages and absolute values don't add up */
+			merged = o->adj;
+			if (!merge_adjust(&merged, &adj)) break;
+			adj = merged;
+		}
+		else if (evt->action == f_pause || evt->action == f_random)
+		{
+			if (mode < 0 && o->mode < 0)
+			{
+				/* Two toggles are none at all */
+				offline_remove(i);
+				return;
+			}
+
+			if (mode < 0) mode = !o->mode;
+		}
+		else if (strcmp(o->evt->args ? o->evt->args : "", evt->args ? evt->args : "") != 0)
+		{
+			continue;
+		}
+
+		offline_remove(i);
+		break;
+	}
+
+	if (offline.count >= EMPCD_OFFLINE_SIZE)
+	{
+		dolog(LOG_INFO, "%s and the offline queue is full, dropping %s(%s)\n", why,
+			queue_action_name(evt), evt->args ? evt->args : "");
+		STAT_ADD(queue.offline, 1);
+		return;
+	}
+
+	dolog(LOG_DEBUG, "%s, keeping %s(%s) for later\n", why,
+		queue_action_name(evt), evt->args ? evt->args : "");
+
+	o = &offline.list[offline.count++];
+	o->evt = evt;
+	o->adj = adj;
+	o->mode = mode;
+	clock_gettime(CLOCK_MONOTONIC, &o->at);
+
+	STAT_ADD(offline.kept, 1);
+}
+
+/* MPD is back, execute what was kept unless it got too old */
+static void offline_replay(void);
+static void offline_replay(void)
+{
+	struct empcd_offline_action	*o;
+	struct timespec			now;
+	unsigned int			i;
+
+	if (offline.count == 0) return;
+
+	dolog(LOG_INFO, "MPD is back, replaying %u offline actions\n", offline.count);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Stop when the connection breaks again, the rest stays */
+	for (i = 0; i < offline.count; i++)
+	{
+		o = &offline.list[i];
+
+		if (now.tv_sec - o->at.tv_sec > EMPCD_OFFLINE_MAXAGE)
+		{
+			dolog(LOG_DEBUG, "Not replaying %s(%s), too old\n",
+				queue_action_name(o->evt), o->evt->args ? o->evt->args : "");
+			STAT_ADD(offline.expired, 1);
+			continue;
+		}
+
+		if (o->evt->action == f_volume) mpd_volume(&o->adj);
+		else if (o->evt->action == f_pause) mpd_pause(o->mode);
+		else if (o->evt->action == f_random) mpd_random(o->mode);
+		else evt_run(o->evt);
+
+		/* Including the one that was underway */
+		if (!mpd) break;
+
+		STAT_ADD(offline.replayed, 1);
+	}
+
+	offline.count -= i;
+	memmove(&offline.list[0], &offline.list[i], offline.count * sizeof(offline.list[0]));
+}
+
+/* Consumer side, runs in the executor, executes in queue order */
+static void queue_drain(struct empcd_queue *q);
+static void queue_drain(struct empcd_queue *q)
+{
+	struct empcd_action		*act;
+	const struct empcd_events	*evt;
+	unsigned int			n, tail, head;
+
+	STAT_ADD(q->drains, 1);
+
+	/* Reconnected, catch up even when nothing new is queued */
+	if (mpd && breaker.state == EMPCD_BREAKER_CLOSED) offline_replay();
+
+	tail = q->tail;
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head)
+	{
+		act = &q->ring[tail & (EMPCD_QUEUE_SIZE - 1)];
+		evt = act->evt;
+		n = 1;
+
+		if (evt->group) group_send(evt);
+		else if (evt->requires_mpd && !breaker_allow())
+		{
+			/* MPD is unhealthy, fail fast instead of waiting for deadlines */
+			offline_add(evt, "MPD circuit breaker open");
+		}
+		else if (evt->requires_mpd && !mpd)
+		{
+			/* Wait for the connection, we get kicked when it is ready */
+			if (mpd_cmd.state == EMPCD_LINK_DOWN) link_start(&mpd_cmd);
+			if (mpd_cmd.state != EMPCD_LINK_BACKOFF) break;
+
+			/* A retry waits for the first reconnect, not for longer */
+			if (act->attempts > 0 && mpd_cmd.failures == q->retry_failures) break;
+
+			/* MPD is unreachable, keep what still matters once it is back */
+			offline_add(evt, "MPD not connected");
+		}
+		else
+		{
+			/* What was kept while offline goes first */
+			if (evt->requires_mpd && offline.count > 0)
+			{
+				offline_replay();
+				if (!mpd) continue;
+			}
+
+			mpd_lost = false;
+			n = queue_coalesce(q, tail, head);
+
+			if (n == 1 && mpd_lost && act->attempts == 0 && queue_idempotent(evt))
+			{
+				dolog(LOG_INFO, "MPD connection lost during %s(%s), retrying once reconnected\n",
+					queue_action_name(evt), evt->args ? evt->args : "");
+				act->attempts++;
+				STAT_ADD(q->retried, 1);
+				q->retry_failures = mpd_cmd.failures;
+				continue;
+			}
+		}
+
+		STAT_ADD(q->executed, n);
+
+		tail += n;
+		__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+
+		/* Pick up whatever got queued in the mean time */
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	}
+
+	/* A reload may be waiting for these to be done */
+	if (retired || __atomic_load_n(&retiring, __ATOMIC_RELAXED)) keymap_reap(false);
+
+	mpd_park(mpd);
+}
+
+static void queue_kick(struct empcd_queue *q);
+static void queue_kick(struct empcd_queue *q)
+{
+	uint64_t kick = 1;
+
+	if (write(q->wake.fd, &kick, sizeof(kick)) != sizeof(kick))
+	{
+		doelog(LOG_WARNING, errno, "Couldn't wake up the executor\n");
+	}
+}
+
+static void mpd_state(struct empcd_link *m);
+static void mpd_state(struct empcd_link *m)
+{
+	if (m->state != EMPCD_LINK_READY)
+	{
+		mpd = NULL;
+
+		/* Whatever waits for the connection has to be dropped now */
+		if (m->state == EMPCD_LINK_BACKOFF && queue_depth(&queue) > 0) queue_kick(&queue);
+		return;
+	}
+
+	mpd = m->conn;
+
+	/* Older servers, or ones that refuse to tell, get the status based forms */
+	m->caps = mpd_caps();
+	if (!mpd) return;
+
+	dolog(LOG_DEBUG, "MPD %s connection to %s: seekcur %s, volume %s\n", m->name, m->server->where,
+		(m->caps & EMPCD_CAP_SEEKCUR) ? "yes" : "no",
+		(m->caps & EMPCD_CAP_VOLUME) ? "yes" : "no");
+
+	if (failover.switching)
+	{
+		failover.last_us = failover_us(&failover.started);
+		if (failover.last_us > failover.max_us) failover.max_us = failover.last_us;
+		STAT_ADD(failover.switches, 1);
+		failover.switching = false;
+
+		dolog(LOG_WARNING, "MPD switched to %s in %u us\n", m->server->where, failover.last_us);
+	}
+
+	/* The status mirror needs idle */
+	if (MPD_CAN_IDLE(mpd)) link_start(&mpd_stat);
+
+	/* Run what was waiting, otherwise this parks the connection */
+	queue_kick(&queue);
+}
+
+static void executor_wake(struct empcd_watch *w, uint32_t events);
+static void executor_wake(struct empcd_watch *w, uint32_t UNUSED events)
+{
+	uint64_t kicks;
+
+	if (read(w->fd, &kicks, sizeof(kicks)) != sizeof(kicks)) return;
+
+	queue_drain((struct empcd_queue *)w->data);
+}
+
+static void *executor(void *arg);
+static void *executor(void UNUSED *arg)
+{
+	/* Connecting happens here, main never waits for MPD */
+	if (!nompd)
+	{
+		link_start(&mpd_cmd);
+		failover_start();
+		group_start();
+	}
+
+	loop_run(&exec_loop);
+	return NULL;
+}
+
+static void log_event(const struct input_event *ev, struct empcd_events *evt);
+static void log_event(const struct input_event *ev, struct empcd_events *evt)
+{
+	char				buf[1024];
+	unsigned int			i, n = 0;
+	struct empcd_mapping		*map = NULL, *val = NULL;
+	const struct empcd_funcs	*func = func_map;
+
+	if (ev->type == EV_KEY)
+	{
+		map = key_event_map;
+		val = key_value_map;
+	}
+
+	if (map)
+	{
+		for (i=0; map[i].code != EMPCD_MAPPING_END && map[i].code != ev->code; i++);
+		map = &map[i];
+	}
+
+	if (val)
+	{
+		for (i=0; val[i].code != EMPCD_MAPPING_END && val[i].code != ev->value; i++);
+		val = &val[i];
+	}
+
+	if (evt)
+	{
+		for (i=0; func[i].name != NULL && func[i].function != evt->action; i++);
+		func = &func[i];
+	}
+
+	n += snprintf(&buf[n], sizeof(buf)-n, "Event: T%lu.%06lu, type %u, code %u, value %d",
+			ev->time.tv_sec, ev->time.tv_usec, ev->type,
+			ev->code, ev->value);
+
+	if (map)
+	{
+		n += snprintf(&buf[n], sizeof(buf)-n, ": %s, name: %s, desc: %s",
+				val ? val->name : "<unknown value>",
+				map->name, map->desc);
+	}
+
+	if (evt)
+	{
+		n += snprintf(&buf[n], sizeof(buf)-n, ", action: %s(%s)",
+				func->name ? func->name : "?",
+				evt->args ? evt->args : "");
+	}
+
+	dolog(LOG_DEBUG, "%s\n", buf);
+}
+
+/* Returns true when actions where queued for the executor */
+static bool handle_event(struct empcd_keymap *keymap, const struct input_event *ev, uint32_t frame);
+static bool handle_event(struct empcd_keymap *keymap, const struct input_event *ev, uint32_t frame)
+{
+	struct empcd_keystate	*st;
+	struct empcd_events	*evt;
+	int32_t			prev_value;
+	bool			matched = false, queued = false;
+
+	/* Nothing is mapped for this type & code at all */
+	st = keymap_state(keymap, ev->type, ev->code, false);
+	if (!st)
+	{
+		if (verbosity > 5) log_event(ev, NULL);
+		return false;
+	}
+
+	/* Note the 'previous' value */
+	prev_value = st->value;
+	st->value = ev->value;
+
+	/* Multiple actions can be set for an event, they are chained in the same bucket */
+	for (	evt = keymap->events[keymap_hash(ev->type, ev->code, ev->value) & (keymap->events_size - 1)];
+		evt;
+		evt = evt->next)
+	{
+		/* Other events that hash into the same bucket */
+		if (	evt->type != ev->type ||
+			evt->code != ev->code ||
+			evt->value != ev->value)
+		{
+			continue;
+		}
+
+		/* This is the night^Wevent */
+		matched = true;
+
+		if (verbosity > 2) log_event(ev, evt);
+
+		/* Handle REPEAT and then UP event for keys */
+		if (	ev->type == EV_KEY &&
+			ev->value == EV_KEY_UP &&
+			evt->norepeat &&
+			prev_value == EV_KEY_REPEAT)
+		{
+			/* Ignore this event */
+			continue;
+		}
+
+		if (queue_push(&queue, evt, frame)) queued = true;
+	}
+
+	if (!matched && verbosity > 5) log_event(ev, NULL);
+
+	return queued;
+}
+
+/* Returns true when actions where queued for the executor */
+static bool handle_frame(struct empcd_device *dev, const struct input_event *ev, unsigned int n);
+static bool handle_frame(struct empcd_device *dev, const struct input_event *ev, unsigned int n)
+{
+	unsigned int	i;
+	bool		queued = false;
+
+	for (i = 0; i < n; i++)
+	{
+		if (handle_event(dev->keymap, &ev[i], frameno)) queued = true;
+	}
+
+	dev->frames++;
+	frameno++;
+
+	return queued;
+}
+
+/*
+ * Some remotes show up as two event devices and report every
+ * press on both, the same frame from another device moments
+ * after the previous one is dropped.
+ */
+static bool frame_duplicate(const struct empcd_device *dev, const struct input_event *ev, unsigned int n);
+static bool frame_duplicate(const struct empcd_device *dev, const struct input_event *ev, unsigned int n)
+{
+	long long	ms;
+	unsigned int	i;
+
+	if (	dedup_window > 0 &&
+		dedup.dev != NULL &&
+		dedup.dev != dev &&
+		dedup.len == n)
+	{
+		ms =	((long long)ev[0].time.tv_sec - dedup.time.tv_sec) * 1000 +
+			((long long)ev[0].time.tv_usec - dedup.time.tv_usec) / 1000;
+
+		for (i = 0; i < n; i++)
+		{
+			if (	ev[i].type != dedup.frame[i].type ||
+				ev[i].code != dedup.frame[i].code ||
+				ev[i].value != dedup.frame[i].value)
+			{
+				break;
+			}
+		}
+
+		if (i == n && ms >= -(long long)dedup_window && ms <= (long long)dedup_window) return true;
+	}
+
+	dedup.dev = dev;
+	dedup.time = ev[0].time;
+	dedup.len = n;
+	memcpy(dedup.frame, ev, n * sizeof(ev[0]));
+
+	return false;
+}
+
+static bool timeval_before(const struct timeval *a, const struct timeval *b);
+static bool timeval_before(const struct timeval *a, const struct timeval *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/*
+ * After every loop round: the frames read from all devices,
+ * oldest first by their kernel timestamp. A device with more
+ * to read can still have older frames than those read from
+ * the others, newer ones wait for the next round then.
+ */
+static void devices_dispatch(struct empcd_loop *l);
+static void devices_dispatch(struct empcd_loop UNUSED *l)
+{
+	struct empcd_device	*dev, *first;
+	const struct timeval	*limit = NULL;
+	unsigned int		end;
+	bool			queued = false;
+
+	for (dev = devices; dev; dev = dev->next)
+	{
+		if (	dev->backlog && dev->readylen > 0 &&
+			(!limit || timeval_before(&dev->ready[dev->readylen - 1].time, limit)))
+		{
+			limit = &dev->ready[dev->readylen - 1].time;
+		}
+	}
+
+	for (;;)
+	{
+		first = NULL;
+		for (dev = devices; dev; dev = dev->next)
+		{
+			if (dev->readypos == dev->readylen) continue;
+
+			if (	!first ||
+				timeval_before(&dev->ready[dev->readypos].time, &first->ready[first->readypos].time))
+			{
+				first = dev;
+			}
+		}
+
+		if (!first || (limit && timeval_before(limit, &first->ready[first->readypos].time))) break;
+
+		/* The closing SYN_REPORT was kept, it goes along for EV_SYN mappings */
+		for (end = first->readypos; first->ready[end].type != EV_SYN || first->ready[end].code != SYN_REPORT; end++);
+
+		if (frame_duplicate(first, &first->ready[first->readypos], end - first->readypos))
+		{
+			if (verbosity > 2) dolog(LOG_DEBUG, "Duplicate frame from %s, ignoring it\n", first->path);
+			first->duplicates++;
+		}
+		else if (handle_frame(first, &first->ready[first->readypos], end - first->readypos + 1))
+		{
+			queued = true;
+		}
+
+		first->readypos = end + 1;
+	}
+
+	for (dev = devices; dev; dev = dev->next)
+	{
+		dev->readylen -= dev->readypos;
+		memmove(dev->ready, &dev->ready[dev->readypos], dev->readylen * sizeof(dev->ready[0]));
+		dev->readypos = 0;
+	}
+
+	/* Wake up the executor once for all of them */
+	if (queued) queue_kick(&queue);
+}
+
+/* The frame is complete, keep it for the end of the round */
+static void device_ready(struct empcd_device *dev);
+static void device_ready(struct empcd_device *dev)
+{
+	struct input_event *syn;
+
+	/* device_read() only reads when there is room for everything a read can bring */
+	memcpy(&dev->ready[dev->readylen], dev->frame, dev->framelen * sizeof(dev->frame[0]));
+	dev->readylen += dev->framelen;
+
+	syn = &dev->ready[dev->readylen++];
+	memset(syn, 0, sizeof(*syn));
+	syn->time = dev->frame[0].time;
+	syn->type = EV_SYN;
+	syn->code = SYN_REPORT;
+
+	dev->framelen = 0;
+}
+
+#define BITS_PER_LONG		(sizeof(long) * 8)
+#define NBITS(x)		((((x) - 1) / BITS_PER_LONG) + 1)
+#define TEST_BIT(bit, array)	((array[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+/*
+ * Fetch the current key/switch/axis state from the kernel
+ * Used at startup and after the kernel dropped events (SYN_DROPPED)
+ * so that the 'previous' values match reality again.
+ */
+static void device_resync(struct empcd_device *dev, struct empcd_keymap *km);
+static void device_resync(struct empcd_device *dev, struct empcd_keymap *km)
+{
+	unsigned long		keys[NBITS(KEY_CNT)], sws[NBITS(SW_CNT)];
+	struct input_absinfo	abs;
+	struct empcd_keystate	*st;
+	bool			havekeys, havesws;
+	unsigned int		i, n = 0;
+
+	memset(keys, 0, sizeof(keys));
+	memset(sws, 0, sizeof(sws));
+	havekeys = (ioctl(dev->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0);
+	havesws = (ioctl(dev->fd, EVIOCGSW(sizeof(sws)), sws) >= 0);
+
+	if (!havekeys && !havesws)
+	{
+		doelog(LOG_DEBUG, errno, "Couldn't fetch key state of %s\n", dev->path);
+		return;
+	}
+
+	for (i = 0; i < km->states_size; i++)
+	{
+		for (st = km->states[i]; st; st = st->next)
+		{
+			if (st->type == EV_KEY && havekeys && st->code < KEY_CNT)
+			{
+				st->value = TEST_BIT(st->code, keys) ? EV_KEY_DOWN : EV_KEY_UP;
+			}
+			else if (st->type == EV_SW && havesws && st->code < SW_CNT)
+			{
+				st->value = TEST_BIT(st->code, sws);
+			}
+			else if (st->type == EV_ABS && st->code < ABS_CNT &&
+				ioctl(dev->fd, EVIOCGABS(st->code), &abs) >= 0)
+			{
+				st->value = abs.value;
+			}
+			else continue;
+
+			n++;
+		}
+	}
+
+	dolog(LOG_DEBUG, "Synchronized %u key states of %s\n", n, dev->path);
+}
+
+static void device_event(struct empcd_device *dev, struct input_event *ev);
+static void device_event(struct empcd_device *dev, struct input_event *ev)
+{
+	dev->events++;
+
+	if (ev->type == EV_SYN && ev->code == SYN_DROPPED)
+	{
+		/* The kernel buffer overflowed, this frame is incomplete */
+		if (!dev->syncing)
+		{
+			dev->dropped++;
+			dolog(LOG_WARNING, "Events dropped by the kernel on %s, resynchronizing\n", dev->path);
+		}
+
+		dev->framelen = 0;
+		dev->syncing = true;
+		return;
+	}
+
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+	{
+		if (dev->syncing)
+		{
+			/* Everything up to and including this report is unreliable */
+			dev->syncing = false;
+			dev->framelen = 0;
+			device_resync(dev, dev->keymap);
+		}
+
+		/* End of frame, hand it over as a whole */
+		else if (dev->framelen > 0) device_ready(dev);
+
+		return;
+	}
+
+	/* Other EV_SYN codes (SYN_MT_REPORT) are part of the frame */
+
+	if (dev->syncing) return;
+
+	/* Frame way too big, dispatch what we have so nothing gets lost */
+	if (dev->framelen >= (sizeof(dev->frame)/sizeof(dev->frame[0])))
+	{
+		dolog(LOG_DEBUG, "Frame on %s exceeds %u events, splitting it\n",
+			dev->path, (unsigned int)(sizeof(dev->frame)/sizeof(dev->frame[0])));
+		device_ready(dev);
+	}
+
+	dev->frame[dev->framelen++] = *ev;
+}
+
+/*
+ * Hotplug
+ * An inotify watch on /dev/input (or the directory of a configured path)
+ * reports new nodes, a matching one is attached right away instead of
+ * polling for it. An unplugged device (ENODEV) is detached and waited for.
+ */
+static bool device_parse(struct empcd_device *dev);
+static bool device_parse(struct empcd_device *dev)
+{
+	unsigned int vendor, product;
+
+	if (strncasecmp("name:", dev->path, 5) == 0)
+	{
+		dev->match = EMPCD_MATCH_NAME;
+		dev->matcharg = &dev->path[5];
+	}
+	else if (strncasecmp("phys:", dev->path, 5) == 0)
+	{
+		dev->match = EMPCD_MATCH_PHYS;
+		dev->matcharg = &dev->path[5];
+	}
+	else if (strncasecmp("id:", dev->path, 3) == 0)
+	{
+		if (	sscanf(&dev->path[3], "%x:%x", &vendor, &product) != 2 ||
+			vendor > 0xffff || product > 0xffff)
+		{
+			dolog(LOG_ERR, "Event device %s should be id:<vendor>:<product> in hex\n", dev->path);
+			return false;
+		}
+
+		dev->match = EMPCD_MATCH_ID;
+		dev->matcharg = &dev->path[3];
+		dev->vendor = vendor;
+		dev->product = product;
+	}
+	else
+	{
+		dev->match = EMPCD_MATCH_PATH;
+		dev->matcharg = dev->path;
+	}
+
+	return true;
+}
+
+/* Is the opened node the device? name gets what it calls itself */
+static bool device_matches(struct empcd_device *dev, int fd, char *name, unsigned int namelen);
+static bool device_matches(struct empcd_device *dev, int fd, char *name, unsigned int namelen)
+{
+	struct input_id	id;
+	char		phys[256];
+
+	memset(name, 0, namelen);
+	if (ioctl(fd, EVIOCGNAME(namelen - 1), name) < 0) name[0] = '\0';
+
+	switch (dev->match)
+	{
+	case EMPCD_MATCH_NAME:
+		return strcmp(name, dev->matcharg) == 0;
+
+	case EMPCD_MATCH_ID:
+		return	ioctl(fd, EVIOCGID, &id) >= 0 &&
+			id.vendor == dev->vendor &&
+			id.product == dev->product;
+
+	case EMPCD_MATCH_PHYS:
+		memset(phys, 0, sizeof(phys));
+		return	ioctl(fd, EVIOCGPHYS(sizeof(phys) - 1), phys) >= 0 &&
+			strcmp(phys, dev->matcharg) == 0;
+
+	case EMPCD_MATCH_PATH:
+	default:
+		return true;
+	}
+}
+
+static void device_detach(struct empcd_device *dev);
+static void device_detach(struct empcd_device *dev)
+{
+	loop_del(&loop, &dev->watch);
+	close(dev->fd);
+	dev->fd = -1;
+	dev->watch.fd = -1;
+
+	/* Whatever was half read or half a frame is gone with it */
+	dev->buflen = 0;
+	dev->framelen = 0;
+	dev->syncing = false;
+	dev->detaches++;
+}
+
+/* Open node and attach to it when it is the device */
+/* A failed open is logged at level, -1 when the caller reports errno */
+static bool device_attach(struct empcd_device *dev, const char *node, int level);
+static bool device_attach(struct empcd_device *dev, const char *node, int level)
+{
+	struct empcd_device	*other;
+	struct stat		sb;
+	char			name[256];
+	int			fd, version, clk = CLOCK_MONOTONIC;
+
+	fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (level >= 0) doelog(level, errno, "Couldn't open event device %s\n", node);
+		return false;
+	}
+
+	if (!device_matches(dev, fd, name, sizeof(name)))
+	{
+		close(fd);
+		return false;
+	}
+
+	/* Another device section already has it, eg both nodes of a remote by name */
+	sb.st_rdev = 0;
+	if (fstat(fd, &sb) == 0 && S_ISCHR(sb.st_mode))
+	{
+		for (other = devices; other; other = other->next)
+		{
+			if (other != dev && other->fd >= 0 && other->rdev == sb.st_rdev) break;
+		}
+
+		if (other)
+		{
+			close(fd);
+			return false;
+		}
+	}
+
+	/* Obtain Exclusive device access */
+	if (dev->exclusive)
+	{
+		ioctl(fd, EVIOCGRAB, 1);
+	}
+
+	/* Timestamps of all devices are compared, a clock that doesn't jump helps */
+	ioctl(fd, EVIOCSCLOCKID, &clk);
+
+	/* Anything else, eg a pipe to test with, ends frames itself */
+	dev->evdev = (ioctl(fd, EVIOCGVERSION, &version) == 0);
+
+	dev->fd = fd;
+	dev->rdev = S_ISCHR(sb.st_mode) ? sb.st_rdev : 0;
+	dev->watch.fd = fd;
+	if (!loop_add(&loop, &dev->watch, EPOLLIN))
+	{
+		close(fd);
+		dev->fd = -1;
+		dev->watch.fd = -1;
+		return false;
+	}
+
+	dev->attaches++;
+	dolog(LOG_INFO, "Attached %s%s%s%s\n", node, name[0] ? " (" : "", name, name[0] ? ")" : "");
+
+	/* Start with the current state of the keys */
+	device_resync(dev, dev->keymap);
+
+	return true;
+}
+
+/* Attach to the device if it is there */
+static bool device_scan(struct empcd_device *dev);
+static bool device_scan(struct empcd_device *dev)
+{
+	struct dirent	*de;
+	char		node[300];
+	DIR		*dir;
+
+	if (dev->match == EMPCD_MATCH_PATH) return device_attach(dev, dev->path, -1);
+
+	dir = opendir(EMPCD_INPUT_DIR);
+	if (!dir)
+	{
+		doelog(LOG_ERR, errno, "Couldn't look for event devices in %s\n", EMPCD_INPUT_DIR);
+		return false;
+	}
+
+	while (dev->fd < 0 && (de = readdir(dir)) != NULL)
+	{
+		if (strncmp(de->d_name, "event", 5) != 0) continue;
+
+		snprintf(node, sizeof(node), "%s/%s", EMPCD_INPUT_DIR, de->d_name);
+		device_attach(dev, node, LOG_DEBUG);
+	}
+
+	closedir(dir);
+
+	return dev->fd >= 0;
+}
 
-		/* Trim trailing space if it is there */
-		if (j>0 && buf[j-1] == ' ') j--;
+static void device_hotplug(struct empcd_watch *w, uint32_t events);
+static void device_hotplug(struct empcd_watch *w, uint32_t UNUSED events)
+{
+	struct empcd_device		*dev = (struct empcd_device *)w->data;
+	const struct inotify_event	*ie;
+	const char			*base;
+	char				buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char				node[300];
+	ssize_t				n, i;
 
-		/* Terminate our new constructed string */
-		buf[j] = '\0';
-		n = j;
+	base = strrchr(dev->path, '/');
+	base = base ? base + 1 : dev->path;
 
-		/* Empty or comment line? */
-		if (	n == 0 ||
-			buf[0] == '#' ||
-			(buf[0] == '/' && buf[1] == '/'))
+	while ((n = read(w->fd, buf, sizeof(buf))) > 0)
+	{
+		for (i = 0; i < n; i += sizeof(*ie) + ie->len)
 		{
-			continue;
-		}
+			ie = (const struct inotify_event *)&buf[i];
 
-		dolog(LOG_DEBUG, "%s@%04u: %s\n", cfgfile, line, buf);
+			/* Already attached, or nothing with a name */
+			if (dev->fd >= 0 || ie->len == 0) continue;
 
-		if (strncasecmp("mpd_host ", buf, 9) == 0)
-		{
-			dolog(LOG_DEBUG, "Setting MPD_HOST to %s\n", &buf[9]);
-			if (mpd_host) free(mpd_host);
-			mpd_host = strdup(&buf[9]);
-		}
-		else if (strncasecmp("mpd_port ", buf, 9) == 0)
-		{
-			dolog(LOG_DEBUG, "Setting MPD_PORT to %s\n", &buf[9]);
-			if (mpd_port) free(mpd_port);
-			mpd_port = strdup(&buf[9]);
-		}
-		else if (strncasecmp("eventdevice ", buf, 12) == 0)
-		{
-			if (*device) free(*device);
-			*device = strdup(&buf[12]);
-		}
-		else if (strncasecmp("exclusive ", buf, 10) == 0)
-		{
-			if (strncasecmp("on", &buf[10], 2) == 0) exclusive = true;
-			else if (strncasecmp("off", &buf[10], 3) == 0) exclusive = false;
-			else
+			/*
+			 * udev fixes the permissions after creating it, thus IN_ATTRIB too
+			 * After dropping privileges an EACCES here is what keeps us waiting
+			 */
+			if (dev->match == EMPCD_MATCH_PATH)
 			{
-				dolog(LOG_ERR, "Exclusive is either 'on' or 'off'\n");
-				ret = -line;
-				break;
+				if (strcmp(ie->name, base) == 0) device_attach(dev, dev->path, LOG_WARNING);
 			}
-		}
-		else if (strncasecmp("exclusive", buf, 9) == 0)
-		{
-			exclusive = true;
-		}
-		else if (strncasecmp("nonexclusive", buf, 12) == 0)
-		{
-			exclusive = false;
-		}
-		else if (strncasecmp("key ", buf, 4) == 0)
-		{
-			if (!set_event_from_map(&buf[4], key_event_map, key_value_map))
+			else if (strncmp(ie->name, "event", 5) == 0)
 			{
-				ret = -line;
-				break;
+				snprintf(node, sizeof(node), "%s/%s", EMPCD_INPUT_DIR, ie->name);
+				device_attach(dev, node, LOG_WARNING);
 			}
 		}
-		else if (strncasecmp("custom ", buf, 7) == 0)
+	}
+}
+
+/* No watch means no hotplug, a device that goes away ends empcd like it used to */
+static void hotplug_init(struct empcd_device *dev);
+static void hotplug_init(struct empcd_device *dev)
+{
+	const char	*dir = EMPCD_INPUT_DIR, *slash;
+	char		buf[300];
+
+	if (dev->match == EMPCD_MATCH_PATH)
+	{
+		slash = strrchr(dev->path, '/');
+		if (!slash) dir = ".";
+		else if (slash == dev->path) dir = "/";
+		else
 		{
-			if (!set_event_from_custom(&buf[7]))
-			{
-				ret = -line;
-				break;
-			}
+			snprintf(buf, sizeof(buf), "%.*s", (int)(slash - dev->path), dev->path);
+			dir = buf;
 		}
-		else if (strncasecmp("user ", buf, 5) == 0)
+	}
+
+	dev->hotplug.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	dev->hotplug.handler = device_hotplug;
+	dev->hotplug.data = dev;
+
+	if (	dev->hotplug.fd < 0 ||
+		inotify_add_watch(dev->hotplug.fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0 ||
+		!loop_add(&loop, &dev->hotplug, EPOLLIN))
+	{
+		doelog(LOG_WARNING, errno, "Couldn't watch %s, %s won't be attached when plugged in\n", dir, dev->path);
+		if (dev->hotplug.fd >= 0) close(dev->hotplug.fd);
+		dev->hotplug.fd = -1;
+	}
+}
+
+/*
+ * Drain the device, many events per read()
+ * Returns false when the device is gone
+ */
+static bool device_read(struct empcd_device *dev);
+static bool device_read(struct empcd_device *dev)
+{
+	ssize_t		n;
+	unsigned int	i, cnt;
+
+	do
+	{
+		/*
+		 * The frames of this round are dispatched in timestamp order with those of
+		 * the other devices, the rest stays for the next round (epoll reports it again)
+		 */
+		dev->backlog = (dev->readylen + EMPCD_READY_READ > EMPCD_READY_EVENTS);
+		if (dev->backlog) break;
+
+		n = read(dev->fd, ((char *)dev->buf) + dev->buflen, sizeof(dev->buf) - dev->buflen);
+		if (n < 0)
 		{
-			struct passwd *passwd;
+			if (errno == EINTR || errno == EAGAIN) break;
 
-			/* setuid()+setgid() to another user+group */
-			passwd = getpwnam(&buf[5]);
-			if (passwd)
-			{
-				drop_uid = passwd->pw_uid;
-				drop_gid = passwd->pw_gid;
-			}
-			else
+			/* Unplugged, it is attached again when it returns */
+			if (errno == ENODEV && dev->hotplug.fd >= 0)
 			{
-				dolog(LOG_ERR, "Couldn't find user %s\n", optarg);
-				ret = -line;
-				break;
+				dolog(LOG_WARNING, "Device %s unplugged, waiting for it to return\n", dev->path);
+				device_detach(dev);
+				return true;
 			}
+
+			doelog(LOG_ERR, errno, "Reading from %s failed\n", dev->path);
+			return false;
 		}
-		else if (strncasecmp("giveup", buf, 6) == 0)
-		{
-			giveup = true;
-		}
-		else if (strncasecmp("dontgiveup", buf, 10) == 0)
-		{
-			giveup = false;
-		}
-		else if (strncasecmp("nompd", buf, 5) == 0)
+
+		if (n == 0)
 		{
-			nompd = true;
+			if (!dev->evdev && dev->framelen > 0) device_ready(dev);
+			dolog(LOG_ERR, "Device %s closed\n", dev->path);
+			return false;
 		}
-		else
+
+		dev->reads++;
+		dev->buflen += n;
+
+		cnt = dev->buflen / sizeof(dev->buf[0]);
+		for (i = 0; i < cnt; i++)
 		{
-			dolog(LOG_ERR, "Unrecognized configuration line %u: %s\n", line, buf);
-			ret = -line;
-			break;
+			device_event(dev, &dev->buf[i]);
 		}
-	}
 
-	fclose(f);
+		/* Keep a short read around till the rest of it arrives */
+		n = dev->buflen - (cnt * sizeof(dev->buf[0]));
+		if (n > 0) memmove(dev->buf, &dev->buf[cnt], n);
+		dev->buflen = n;
 
-	return ret == 0 ? (int)line : ret;
+		/* A full buffer means there is likely more waiting */
+	} while (cnt == (sizeof(dev->buf)/sizeof(dev->buf[0])));
+
+	/* A pipe or file might never send a SYN_REPORT, what was read is a frame then */
+	if (!dev->evdev && dev->framelen > 0) device_ready(dev);
+
+	return true;
 }
 
-static void handle_event(struct input_event *ev);
-static void handle_event(struct input_event *ev)
+static void device_readable(struct empcd_watch *w, uint32_t events);
+static void device_readable(struct empcd_watch *w, uint32_t UNUSED events)
 {
-	struct empcd_events	*evt;
-	unsigned int		i, i_event;
+	struct empcd_device *dev = (struct empcd_device *)w->data;
+
+	if (!device_read(dev)) loop_stop(&loop);
+
+	/* It may have been plugged back in before the unplug was noticed */
+	else if (dev->fd < 0) device_scan(dev);
+}
 
-	/* Checking all events, thus multiple events can be set for an event */
-	for (i_event = 0; i_event < maxevent; i_event++)
+static void empcd_stats(void);
+static void empcd_stats(void)
+{
+	struct empcd_device	*dev;
+	struct empcd_group	*g;
+	struct empcd_coproc	*cp;
+	unsigned int		i, up;
+
+	dolog(LOG_INFO, "Event loop: %llu wakeups, %llu wakeups/hour\n",
+		(unsigned long long)loop.wakeups,
+		(unsigned long long)loop_wakeups_hour(&loop));
+
+	dolog(LOG_INFO, "Executor: %llu wakeups, %llu wakeups/hour\n",
+		(unsigned long long)__atomic_load_n(&exec_loop.wakeups, __ATOMIC_RELAXED),
+		(unsigned long long)loop_wakeups_hour(&exec_loop));
+
+	dolog(LOG_INFO, "Exec: %u running, %llu started, %llu through /bin/sh, %llu over the limit, %llu failed\n",
+		__atomic_load_n(&children.count, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&children.spawned, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&children.shell, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&children.limited, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&children.failed, __ATOMIC_RELAXED));
+
+	for (cp = coprocs; cp; cp = cp->next)
 	{
-		/* Does not match yet */
-		evt = NULL;
+		dolog(LOG_INFO, "coproc %s: PID %d, %llu lines, %u bytes pending, %llu dropped, %llu restarts\n",
+			cp->name, (int)__atomic_load_n(&cp->pid, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&cp->lines, __ATOMIC_RELAXED),
+			__atomic_load_n(&cp->len, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&cp->dropped, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&cp->restarts, __ATOMIC_RELAXED));
+	}
+
+	dolog(LOG_INFO, "Action queue: depth %u/%u, max depth %u, %llu queued, %llu executed in %llu drains, %llu coalesced, %llu batched, %llu retried, %llu dropped, %llu dropped while offline\n",
+		queue_depth(&queue), EMPCD_QUEUE_SIZE, queue.maxdepth,
+		(unsigned long long)queue.enqueued,
+		(unsigned long long)__atomic_load_n(&queue.executed, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&queue.drains, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&queue.coalesced, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&queue.batched, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&queue.retried, __ATOMIC_RELAXED),
+		(unsigned long long)queue.dropped,
+		(unsigned long long)__atomic_load_n(&queue.offline, __ATOMIC_RELAXED));
 
-		/* Right Type & Code? */
-		if (	events[i_event].type == ev->type &&
-			events[i_event].code == ev->code)
+	if (!nompd)
+	{
+		dolog(LOG_INFO, "MPD: command connection %s, %llu connects, %llu failures; status connection %s, %llu connects, %llu failures\n",
+			__atomic_load_n(&mpd_cmd.state, __ATOMIC_RELAXED) == EMPCD_LINK_READY ? "up" : "down",
+			(unsigned long long)__atomic_load_n(&mpd_cmd.connects, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&mpd_cmd.failures, __ATOMIC_RELAXED),
+			__atomic_load_n(&mpd_stat.state, __ATOMIC_RELAXED) == EMPCD_LINK_READY ? "up" : "down",
+			(unsigned long long)__atomic_load_n(&mpd_stat.connects, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&mpd_stat.failures, __ATOMIC_RELAXED));
+
+		dolog(LOG_INFO, "MPD status: %s, %llu served locally, %llu round-trips, %llu refreshes\n",
+			__atomic_load_n(&mpd_stat.state, __ATOMIC_RELAXED) == EMPCD_LINK_READY ? "mirrored" : "not mirrored",
+			(unsigned long long)__atomic_load_n(&mirror.hits, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&mirror.misses, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&mirror.refreshes, __ATOMIC_RELAXED));
+
+		dolog(LOG_INFO, "MPD offline queue: %u/%u pending, %llu kept, %llu compacted, %llu replayed, %llu expired\n",
+			__atomic_load_n(&offline.count, __ATOMIC_RELAXED), EMPCD_OFFLINE_SIZE,
+			(unsigned long long)__atomic_load_n(&offline.kept, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&offline.compacted, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&offline.replayed, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&offline.expired, __ATOMIC_RELAXED));
+
+		dolog(LOG_INFO, "MPD server: %s (%u of %u), %llu switches, last took %u us, slowest %u us\n",
+			failover.servers[__atomic_load_n(&failover.active, __ATOMIC_RELAXED)].where,
+			__atomic_load_n(&failover.active, __ATOMIC_RELAXED) + 1, failover.count,
+			(unsigned long long)__atomic_load_n(&failover.switches, __ATOMIC_RELAXED),
+			__atomic_load_n(&failover.last_us, __ATOMIC_RELAXED),
+			__atomic_load_n(&failover.max_us, __ATOMIC_RELAXED));
+
+		for (i = 0; failover.count > 1 && i < failover.count; i++)
 		{
-			/* It is this current value, then it is this event */
-			if (events[i_event].value == ev->value)
-			{
-				/* This is the night^Wevent */
-				evt = &events[i_event];
-			}
-			else
-			{
-				/* Note the 'previous' value */
-				events[i_event].prev_value = ev->value;
-			}
+			dolog(LOG_INFO, "MPD server %s: %s, ping %u us, %llu probes, %llu failed\n",
+				failover.servers[i].where,
+				__atomic_load_n(&failover.probes[i].healthy, __ATOMIC_RELAXED) ? "healthy" : "unhealthy",
+				__atomic_load_n(&failover.probes[i].rtt, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&failover.probes[i].probes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&failover.probes[i].failures, __ATOMIC_RELAXED));
 		}
 
-		/* Handle logging */
-		if (	(evt != NULL && verbosity > 2) ||
-			(evt == NULL && verbosity > 5))
+		for (g = groups; g; g = g->next)
 		{
-			char				buf[1024];
-			unsigned int			n = 0;
-			struct empcd_mapping		*map = NULL, *val = NULL;
-			const struct empcd_funcs	*func = func_map;
-
-			if (ev->type == EV_KEY)
+			for (i = 0, up = 0; i < g->count; i++)
 			{
-				map = key_event_map;
-				val = key_value_map;
+				if (__atomic_load_n(&g->members[i].link.state, __ATOMIC_RELAXED) == EMPCD_LINK_READY) up++;
 			}
 
-			if (map)
-			{
-				for (i=0; map[i].code != EMPCD_MAPPING_END && map[i].code != ev->code; i++);
-				map = &map[i];
-			}
+			dolog(LOG_INFO, "MPD group %s: %u/%u members up, %llu actions sent, %llu failed on a member\n",
+				g->name, up, g->count,
+				(unsigned long long)__atomic_load_n(&g->sent, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&g->failed, __ATOMIC_RELAXED));
+		}
 
-			if (val)
-			{
-				for (i=0; val[i].code != EMPCD_MAPPING_END && val[i].code != ev->value; i++);
-				val = &val[i];
-			}
+		dolog(LOG_INFO, "MPD circuit breaker: %s, %llu trips, %llu actions failed fast\n",
+			breaker_name(__atomic_load_n(&breaker.state, __ATOMIC_RELAXED)),
+			(unsigned long long)__atomic_load_n(&breaker.trips, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&breaker.rejected, __ATOMIC_RELAXED));
+	}
 
-			if (evt)
-			{
-				for (i=0; func[i].name != NULL && func[i].function != evt->action; i++);
-				func = &func[i];
-			}
+	for (dev = devices; dev; dev = dev->next)
+	{
+		dolog(LOG_INFO, "%s: %s, %llu events in %llu frames using %llu reads, %llu dropped frames, %llu duplicates, %llu attaches, %llu detaches\n",
+			dev->path,
+			dev->fd >= 0 ? "attached" : "not attached",
+			(unsigned long long)dev->events,
+			(unsigned long long)dev->frames,
+			(unsigned long long)dev->reads,
+			(unsigned long long)dev->dropped,
+			(unsigned long long)dev->duplicates,
+			(unsigned long long)dev->attaches,
+			(unsigned long long)dev->detaches);
+	}
+}
 
-			n += snprintf(&buf[n], sizeof(buf)-n, "Event: T%lu.%06lu, type %u, code %u, value %d",
-					ev->time.tv_sec, ev->time.tv_usec, ev->type,
-					ev->code, ev->value);
+/* Into the new keymap of a device, upnr needs to know about a repeat in progress */
+static void keymap_carry(struct empcd_keymap *km, struct empcd_keymap *old);
+static void keymap_carry(struct empcd_keymap *km, struct empcd_keymap *old)
+{
+	struct empcd_keystate	*st, *prev;
+	unsigned int		i;
 
-			if (map)
-			{
-				n += snprintf(&buf[n], sizeof(buf)-n, ": %s, name: %s, desc: %s",
-						val ? val->name : "<unknown value>",
-						map->name ? map->name : "<unknown name>",
-						map->desc ? map->desc : "");
-			}
+	for (i = 0; i < km->states_size; i++)
+	{
+		for (st = km->states[i]; st; st = st->next)
+		{
+			prev = keymap_state(old, st->type, st->code, false);
+			if (prev) st->value = prev->value;
+		}
+	}
+}
 
-			if (evt)
-			{
-				n += snprintf(&buf[n], sizeof(buf)-n, ", action: %s(%s)",
-						func->name ? func->name : "?",
-						evt->args ? evt->args : "");
-			}
+/* SIGHUP: fresh keymaps from the same file, the devices and MPD stay as they are */
+static void config_reload(void);
+static void config_reload(void)
+{
+	struct empcd_device	*dev;
+	struct empcd_keymap	*km, *old;
+	unsigned int		mappings = 0;
+	bool			missing = false;
+	int			j;
+
+	km = keymap_new();
+	if (!km)
+	{
+		dolog(LOG_ERR, "Out of memory, not reloading\n");
+		return;
+	}
 
-			dolog(LOG_DEBUG, "%s\n", buf);
-		}
+	exec_limit = EMPCD_EXEC_LIMIT;
+	j = readconfig(config, true, km);
 
-		if (!evt) continue;
+	/* Without eventdevice lines everything is for the one device */
+	if (j > 0 && !devices->pending && !devices->next) devices->pending = km;
 
-		/* Handle REPEAT and then UP event for keys */
-		if (	ev->type == EV_KEY &&
-			ev->value == EV_KEY_UP &&
-			evt->norepeat)
+	for (dev = devices; j > 0 && dev; dev = dev->next) missing |= !dev->pending;
+
+	if (j <= 0 || missing)
+	{
+		if (missing) dolog(LOG_ERR, "Changing the eventdevice lines needs a restart, keeping the current mappings\n");
+		else if (j == 0) dolog(LOG_ERR, "Configuration file '%s' not found, keeping the current mappings\n", config);
+		else dolog(LOG_ERR, "Parse error in configuration file '%s' on line %u, keeping the current mappings\n", config, (unsigned int)-j);
+
+		for (dev = devices; dev; dev = dev->next)
 		{
-			/* Was it noted that we before had a repeat event? */
-			if (evt->prev_value == EV_KEY_REPEAT)
-			{
-				/* Ignore this event, but reset the previous */
-				evt->prev_value = -1;
-				continue;
-			}
+			if (dev->pending != km) keymap_free(dev->pending);
+			dev->pending = NULL;
 		}
 
-		evt->action(evt->args, evt->needargs);
+		keymap_free(km);
+		return;
+	}
+
+	/* Between loop rounds, every frame is dispatched with either one as a whole */
+	for (dev = devices; dev; dev = dev->next)
+	{
+		old = dev->keymap;
+		keymap_carry(dev->pending, old);
+
+		dev->keymap = dev->pending;
+		dev->pending = NULL;
+		mappings += dev->keymap->events_count;
+
+		keymap_retire(old);
+	}
+
+	queue_kick(&queue);
+
+	dolog(LOG_INFO, "Reloaded %s, %u mappings\n", config, mappings);
+}
+
+static void handle_signal(struct empcd_watch *w, uint32_t events);
+static void handle_signal(struct empcd_watch *w, uint32_t UNUSED events)
+{
+	struct signalfd_siginfo	si;
+
+	while (read(w->fd, &si, sizeof(si)) == sizeof(si))
+	{
+		switch (si.ssi_signo)
+		{
+		case SIGHUP:
+			config_reload();
+			break;
+
+		case SIGUSR1:
+			/* Dump statistics */
+			empcd_stats();
+			break;
+
+		default:
+			/* When we receive a signal, we abort */
+			dolog(LOG_INFO, "Received signal %u, exiting\n", si.ssi_signo);
+			loop_stop(&loop);
+			break;
+		}
 	}
 }
 
 /* Long options */
 static struct option const long_options[] = {
+	{"benchmark-listing",	required_argument,	NULL, 'A'},
+	{"benchmark",		required_argument,	NULL, 'B'},
 	{"config",		required_argument,	NULL, 'c'},
 	{"daemonize",		no_argument,		NULL, 'd'},
 	{"eventdevice",		required_argument,	NULL, 'e'},
@@ -986,7 +4883,7 @@ static struct option const long_options[] = {
 	{NULL,			no_argument,		NULL, 0},
 };
 
-static char short_options[] = "c:de:fgGhKLnqu:vVxXy:";
+static char short_options[] = "A:B:c:de:fgGhKLnqu:vVxXy:";
 
 static struct
 {
@@ -994,12 +4891,14 @@ static struct
 	const char *desc;
 } desc_options[] =
 {
+	/* A:	*/ {"<count>",		"Measure <count> full listings (listallinfo) with the malloc and the arena allocator, hosts as for -B"},
+	/* B:	*/ {"<count>",		"Measure MPD latency with <count> round-trips for MPD_HOST or each [password@]host|/socket argument, then exit"},
 	/* c:	*/ {"<file>",		"Configuration File Location"},
 	/* d	*/ {NULL,		"Detach the program into the background"},
-	/* e:	*/ {"<eventdevice>",	"The event device to use (default: /dev/input/event0)"},
+	/* e:	*/ {"<eventdevice>",	"The event device to use, a path or name:, id: or phys: (default: /dev/input/event0)"},
 	/* f	*/ {NULL,		"Don't detach, stay in the foreground"},
 	/* g	*/ {NULL,		"Give up when opening the device fails (default)"},
-	/* G	*/ {NULL,		"Do not give up when opening the device fails"},
+	/* G	*/ {NULL,		"Do not give up when opening the device fails, wait for it to appear"},
 	/* h	*/ {NULL,		"This help"},
 	/* K	*/ {NULL,		"List the keys that are known to this program"},
 	/* L	*/ {NULL,		"List the functions known to this program"},
@@ -1016,16 +4915,28 @@ static struct
 
 int main (int argc, char **argv)
 {
-	int			fd = -1, option_index, j;
+	int			option_index, j;
 	char			*device = NULL, *conffile = NULL, *t;
 	const char		*cfgfile = NULL;
-	struct input_event	ev;
-	unsigned int		i;
+	struct empcd_device	*dev;
+	struct empcd_keymap	*km;
+	struct empcd_watch	sigwatch;
+	sigset_t		sigs;
+	pthread_t		exec_thread;
+	unsigned int		i, bench = 0, bench_list = 0;
 
 	while ((j = getopt_long(argc, argv, short_options, long_options, &option_index)) != EOF)
 	{
 		switch (j)
 		{
+		case 'A':
+			bench_list = atoi(optarg);
+			break;
+
+		case 'B':
+			bench = atoi(optarg);
+			break;
+
 		case 'c':
 			if (conffile) free(conffile);
 			conffile = strdup(optarg);
@@ -1147,11 +5058,52 @@ int main (int argc, char **argv)
 
 	if (!device) device = strdup("/dev/input/event0");
 
+	km = keymap_new();
+	if (!km)
+	{
+		dolog(LOG_ERR, "Couldn't allocate the event table\n");
+		return 1;
+	}
+
 	if ((t = getenv("MPD_HOST"))) mpd_host = strdup(t);
 	else mpd_host = strdup(MPD_HOST_DEFAULT);
 	if ((t = getenv("MPD_PORT"))) mpd_port = strdup(t);
 	else mpd_port = strdup(MPD_PORT_DEFAULT);
 
+	/* mpd_host, mpd_standby lines come after it */
+	failover.count = 1;
+
+	if (bench > 0 || bench_list > 0)
+	{
+		j = 0;
+
+		/* Hosts to compare, eg a local socket against 127.0.0.1 */
+		for (i = optind; i < (unsigned int)argc || i == (unsigned int)optind; i++)
+		{
+			if (i < (unsigned int)argc)
+			{
+				free(mpd_host);
+				mpd_host = strdup(argv[i]);
+			}
+
+			failover.servers[0].host = mpd_host;
+			failover.servers[0].port = mpd_port;
+			if (!mpd_config(&failover.servers[0]))
+			{
+				j = 1;
+				continue;
+			}
+
+			if (	benchmark_latency(failover.servers[0].hostname, failover.servers[0].iport, failover.servers[0].password, bench) != 0 ||
+				benchmark_listing(failover.servers[0].hostname, failover.servers[0].iport, failover.servers[0].password, bench_list) != 0)
+			{
+				j = 1;
+			}
+		}
+
+		return j;
+	}
+
 	if (!conffile)
 	{
 		/* Try user's config */
@@ -1161,21 +5113,21 @@ int main (int argc, char **argv)
 			char buf[256];
 			snprintf(buf, sizeof(buf), "%s/%s", cfgfile, ".empcd.conf");
 			cfgfile = conffile = strdup(buf);
-			j = readconfig(cfgfile, &device);
+			j = readconfig(cfgfile, false, km);
 		}
 		else j = 0;
 
 		if (j == 0)
 		{
 			cfgfile = "/etc/empcd.conf";
-			j = readconfig(cfgfile, &device);
+			j = readconfig(cfgfile, false, km);
 		}
 	}
 	else
 	{
 		/* Try specified config */
 		cfgfile = conffile;
-		j = readconfig(cfgfile, &device);
+		j = readconfig(cfgfile, false, km);
 	}
 
 	if (j <= 0)
@@ -1191,10 +5143,19 @@ int main (int argc, char **argv)
 
 		if (device) free(device);
 		if (conffile) free(conffile);
+		if (!devices) keymap_free(km);
 
 		return 1;
 	}
 
+	/* Without eventdevice lines there is the one of the commandline */
+	if (!devices && !device_add(device, km)) return 1;
+	free(device);
+	device = NULL;
+
+	/* Kept for reloads */
+	config = strdup(cfgfile);
+
 	if (conffile)
 	{
 		free(conffile);
@@ -1240,68 +5201,95 @@ int main (int argc, char **argv)
 		}
 	}
 
-	/* Handle these signals for a clean exit */
-	signal(SIGHUP,  &handle_signal);
-	signal(SIGTERM, &handle_signal);
-	signal(SIGINT,  &handle_signal);
-	signal(SIGKILL, &handle_signal);
+	if (!loop_init(&loop) || !loop_init(&exec_loop) || !queue_init(&queue)) return 1;
+
+	queue.wake.handler = executor_wake;
+	queue.wake.data = &queue;
+	if (!loop_add(&exec_loop, &queue.wake, EPOLLIN)) return 1;
+
+	/*
+	 * Handle these signals from the event loop:
+	 * SIGTERM/SIGINT for a clean exit, SIGHUP reloads, SIGUSR1 dumps statistics
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+	sigwatch.fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	sigwatch.handler = handle_signal;
+	sigwatch.data = NULL;
+	if (sigwatch.fd < 0 || !loop_add(&loop, &sigwatch, EPOLLIN))
+	{
+		doelog(LOG_ERR, errno, "Couldn't setup signal handling\n");
+		return 1;
+	}
+
+	/* exec children are reaped by the executor */
+	if (!children_init()) return 1;
 
 	/* Ignore some odd signals */
 	signal(SIGILL,  SIG_IGN);
 	signal(SIGABRT, SIG_IGN);
-	signal(SIGUSR1, SIG_IGN);
 	signal(SIGUSR2, SIG_IGN);
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGSTOP, SIG_IGN);
 	signal(SIGTSTP, SIG_IGN);
 	signal(SIGTTIN, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
-	signal(SIGUSR1, SIG_IGN);
-	signal(SIGUSR2, SIG_IGN);
 
-	while (running)
+	for (dev = devices; dev; dev = dev->next)
 	{
-		/* Try to open the device */
-		fd = open(device, O_RDONLY);
-
-		/* Worked? */
-		if (fd >= 0) break;
-
-		doelog(LOG_ERR, errno, "Couldn't open event device %s\n", device);
+		dev->watch.handler = device_readable;
+		dev->watch.data = dev;
+		if (!device_parse(dev)) return 1;
 
-		if (giveup) break;
+		hotplug_init(dev);
 
-		/* Sleep a bit and try it all again, cheap enough to not flood the CPU */
-		sleep(1);
-	}
+		if (!device_scan(dev))
+		{
+			if (dev->match == EMPCD_MATCH_PATH) doelog(LOG_ERR, errno, "Couldn't open event device %s\n", dev->path);
+			else dolog(LOG_ERR, "No event device matches %s\n", dev->path);
 
-	free(device);
-	device = NULL;
+			if (giveup || dev->hotplug.fd < 0)
+			{
+				dolog(LOG_ERR, "Couldn't open event device, gave up\n");
+				return 1;
+			}
 
-	if (fd < 0)
-	{
-		dolog(LOG_ERR, "Couldn't open event device, gave up\n");
-		return 1;
+			dolog(LOG_INFO, "Waiting for event device %s to appear\n", dev->path);
+		}
 	}
 
-	/* Obtain Exclusive device access */
-	if (exclusive)
-	{
-		ioctl(fd, EVIOCGRAB, 1);
-	}
+	/* Frames of all devices go to the queue in the order they happened */
+	loop.flush = devices_dispatch;
 
-	/* Allow usage of empcd without contacting MPD, thus effectively making it a input daemon */
+	/*
+	 * Allow usage of empcd without contacting MPD, thus effectively making it a input daemon
+	 * The executor connects, MPD does not have to be up yet
+	 */
 	if (!nompd)
 	{
-		/* Setup MPD connectivity */
-		mpd = empcd_setup();
-		if (!mpd)
+		failover.servers[0].host = mpd_host;
+		failover.servers[0].port = mpd_port;
+
+		if (	!mpd_config(&failover.servers[0]) ||
+			!link_init(&mpd_cmd, "command", &failover.servers[0], mpd_state, mpd_hangup) ||
+			!link_init(&mpd_stat, "status", &failover.servers[0], mirror_state, mirror_changed) ||
+			!failover_init() ||
+			!group_init())
 		{
-			dolog(LOG_ERR, "Couldn't contact MPD server\n");
 			return 1;
 		}
+
+		breaker.cooldown = EMPCD_BREAKER_COOLDOWN;
 	}
 
+	/* Helpers may need the privileges, their restarts won't get them */
+	if (!coproc_init()) return 1;
+
 	/*
 	 * Drop our root privileges.
 	 * We don't need them anymore anyways
@@ -1331,27 +5319,54 @@ int main (int argc, char **argv)
 		dolog(LOG_INFO, "Running as PID %u, processing your strokes\n", getpid());
 	}
 
-	while (running)
+	/* Actions are executed in their own thread, so they never hold up input */
+	if (running && (errno = pthread_create(&exec_thread, NULL, executor, NULL)) != 0)
 	{
-		struct timeval	tv;
-		fd_set		fdread;
+		doelog(LOG_ERR, errno, "Couldn't start the executor\n");
+		running = false;
+	}
 
-		FD_ZERO(&fdread);
-		FD_SET(fd, &fdread);
-		tv.tv_sec = 5;
-		tv.tv_usec = 0;
-		j = select(fd+1, &fdread, NULL, NULL, &tv);
-		if (j == 0) continue;
-		if (j < 0 || read(fd, &ev, sizeof(ev)) == -1) break;
+	if (running)
+	{
+		loop_run(&loop);
 
-		handle_event(&ev);
+		/* Let the executor finish what is queued, then stop it */
+		loop_stop(&exec_loop);
+		queue_kick(&queue);
+		pthread_join(exec_thread, NULL);
 	}
 
 	dolog(LOG_INFO, "empcd shutting down\n");
 
-	if (!nompd) mpd_closeConnection(mpd);
+	empcd_stats();
+
+	if (!nompd)
+	{
+		link_exit(&mpd_stat);
+		link_exit(&mpd_cmd);
+	}
+
+	failover_exit();
+	coproc_exit();
+	children_exit();
+	group_free();
+	mpd_finishStatus(&mpd_status);
 
-	close(fd);
+	while ((dev = devices))
+	{
+		devices = dev->next;
+		if (dev->fd >= 0) close(dev->fd);
+		if (dev->hotplug.fd >= 0) close(dev->hotplug.fd);
+		keymap_free(dev->keymap);
+		free(dev->path);
+		free(dev);
+	}
+	close(sigwatch.fd);
+	close(queue.wake.fd);
+	loop_exit(&exec_loop);
+	loop_exit(&loop);
+	keymap_reap(true);
+	free(config);
 	return 0;
 }
 
@@ -10,10 +10,21 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <string.h>
 #include <syslog.h>
@@ -21,9 +32,16 @@
 #include <signal.h>
 #include <pwd.h>
 #include <errno.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 /* Linux specific... */
 #include <linux/input.h>
+#ifndef SYN_DROPPED
+#define SYN_DROPPED	3	/* Linux kernel 2.6.38 added this */
+#endif
+
 #ifndef EVIOCGRAB
 #define EVIOCGRAB	_IOW('E', 0x90, int)	/* Grab/Release device, Linux kernel 2.4 headers don't have this */ 
 #endif
@@ -54,16 +72,477 @@
 
 #define snprintfok(ret, bufsize) (((ret) >= 0) && (((unsigned int)(ret)) < bufsize))
 
+/* Statistics are read by empcd_stats() in the main thread, whoever updates them */
+#define STAT_ADD(c, n) ((void)__atomic_fetch_add(&(c), (n), __ATOMIC_RELAXED))
+
+/* Last seen value of a type/code pair, shared by all mappings of that pair */
+struct empcd_keystate
+{
+	struct empcd_keystate	*next;		/* Next in the hash bucket */
+	uint16_t		type;
+	uint16_t		code;
+	int32_t			value;
+};
+
+/* What happens to an MPD action while MPD is unreachable, see offline_add() */
+enum empcd_offline_policy
+{
+	EMPCD_OFFLINE_DROP = 0,		/* Stale by the time MPD is back (next, seek) */
+	EMPCD_OFFLINE_KEEP,		/* Replayed in order */
+	EMPCD_OFFLINE_LAST,		/* Only the final value counts (volume, pause, play) */
+};
+
 struct empcd_events
 {
+	struct empcd_events	*next;		/* Next in the hash bucket */
+	struct empcd_keystate	*state;
 	uint16_t		type;
 	uint16_t 		code;
 	int32_t			value;
-	int32_t			prev_value;
 	bool			norepeat;
 
 	void			(*action)(const char *arg, const char *args);
 	const char		*args, *needargs;
+
+	/*
+	 * The protocol line, rendered at configuration time when it doesn't
+	 * depend on the status: batches and groups send it as is, and so does
+	 * a single run when raw is set (else the action keeps the mirror)
+	 */
+	char			*cmd;
+	unsigned int		cmdlen, deadline;
+	bool			raw;
+
+	/* exec: the command split at configuration time, NULL when it needs /bin/sh */
+	char			**argv;
+	unsigned int		limit;		/* Children at the same time, 0 for no limit */
+
+	/* coproc: the helper and the line for it, newline included */
+	struct empcd_coproc	*coproc;
+	char			*line;
+	unsigned int		linelen;
+
+	bool			requires_mpd;
+	enum empcd_offline_policy offline;
+	struct empcd_group	*group;		/* Target group, NULL for mpd_host */
+};
+
+/*
+ * Hashed event dispatch table
+ * events is keyed by type/code/value, mappings for the same
+ * event are chained in configuration order in the same bucket.
+ * states is keyed by type/code and tracks the previous value.
+ * Both sizes are a power of 2 and grow when they get full.
+ */
+struct empcd_keymap
+{
+	struct empcd_events	**events;
+	unsigned int		events_size, events_count;
+	struct empcd_keystate	**states;
+	unsigned int		states_size, states_count;
+
+	/* Replaced by a reload: the next retired one and the queue head at the swap */
+	struct empcd_keymap	*next;
+	unsigned int		head;
+};
+
+#define EMPCD_KEYMAP_SIZE	64
+
+/*
+ * Event loop
+ * Every file descriptor (input devices, the MPD socket, timerfds, signalfds)
+ * is registered as a watch, its handler is called when epoll reports it.
+ */
+struct empcd_watch
+{
+	int			fd;
+	void			(*handler)(struct empcd_watch *w, uint32_t events);
+	void			*data;
+};
+
+#define EMPCD_LOOP_EVENTS	16
+
+struct empcd_loop
+{
+	int			epfd;
+
+	/* Events of the current epoll_wait() round */
+	struct epoll_event	events[EMPCD_LOOP_EVENTS];
+	int			nevents;
+
+	/* Called after every round, NULL for none */
+	void			(*flush)(struct empcd_loop *l);
+
+	/* Cleared to stop loop_run(), possibly from another thread */
+	bool			running;
+
+	/* Statistics */
+	uint64_t		wakeups;
+	struct timespec		started;
+};
+
+/*
+ * Children of exec mappings
+ * Spawned without waiting for them, reaped by the executor when the
+ * SIGCHLD signalfd fires. Each mapping has a limit on how many of its
+ * children can run at the same time (exec_limit), there is a global one too.
+ */
+#define EMPCD_EXEC_LIMIT	1
+#define EMPCD_CHILDREN_MAX	32
+
+struct empcd_child
+{
+	pid_t				pid;
+	const struct empcd_events	*evt;
+	struct timespec			started;
+};
+
+struct empcd_children
+{
+	struct empcd_child	list[EMPCD_CHILDREN_MAX];
+	unsigned int		count;
+	struct empcd_watch	watch;		/* signalfd for SIGCHLD */
+	posix_spawnattr_t	attr;		/* Default signals, nothing blocked */
+
+	/* Statistics */
+	uint64_t		spawned, shell, limited, failed;
+};
+
+/*
+ * Coprocesses (coproc <name> <command>)
+ * A helper started once that gets a line on its stdin per event instead of
+ * a fork and exec per keypress. The pipe is non-blocking, what the helper
+ * doesn't read right away is kept in buf, lines that don't fit are dropped.
+ */
+#define EMPCD_COPROC_BUFSIZE	4096
+#define EMPCD_COPROC_RESTART	1	/* seconds, at least between two starts */
+
+struct empcd_coproc
+{
+	struct empcd_coproc	*next;
+	char			*name, *command;
+	char			**argv;		/* NULL when it needs /bin/sh */
+	pid_t			pid;		/* 0 while not running */
+	struct empcd_watch	watch;		/* Its stdin, EPOLLOUT while buf isn't empty */
+	struct empcd_watch	timer;		/* Restart */
+	struct timespec		started;
+	char			buf[EMPCD_COPROC_BUFSIZE];
+	unsigned int		len;
+	bool			stalled;	/* Dropping, logged once till buf drains */
+
+	/* Statistics */
+	uint64_t		lines, dropped, restarts;
+};
+
+/*
+ * Action queue between the input path and the executor thread
+ * Single producer/single consumer lock-free ring, head is only
+ * written by the producer, tail only by the consumer.
+ * The producer kicks wakefd (an eventfd) once per frame.
+ */
+struct empcd_action
+{
+	const struct empcd_events	*evt;
+	uint32_t			frame;
+	unsigned int			attempts;	/* Written by the consumer once queued */
+};
+
+#define EMPCD_QUEUE_SIZE	256	/* power of 2 */
+
+struct empcd_queue
+{
+	struct empcd_action	ring[EMPCD_QUEUE_SIZE];
+	unsigned int		head;
+	unsigned int		tail;
+	struct empcd_watch	wake;
+
+	/* Statistics, producer side */
+	uint64_t		enqueued, dropped;
+	unsigned int		maxdepth;
+
+	/* Statistics, consumer side */
+	uint64_t		executed, drains, coalesced, batched, offline, retried;
+
+	/* Link failure count when the action at tail lost its connection */
+	uint64_t		retry_failures;
+};
+
+/* Number of events read() in one go and the maximum events in one SYN_REPORT frame */
+#define EMPCD_READ_EVENTS	64
+#define EMPCD_FRAME_EVENTS	64
+
+/*
+ * Complete frames kept till the end of the loop round, each ends with a SYN_REPORT
+ * One read adds at most its events, the frame carried over from the previous one
+ * and the reports closing split frames; reading stops when that doesn't fit anymore.
+ */
+#define EMPCD_READY_READ	(EMPCD_READ_EVENTS + EMPCD_FRAME_EVENTS + 3)
+#define EMPCD_READY_EVENTS	(4 * EMPCD_READY_READ)
+
+/* The same frame from another device within this many ms is a duplicate */
+#define EMPCD_DEDUP_WINDOW	20
+
+/* How a device is found, by its path or by what it reports about itself */
+enum empcd_match
+{
+	EMPCD_MATCH_PATH = 0,
+	EMPCD_MATCH_NAME,		/* name:<EVIOCGNAME> */
+	EMPCD_MATCH_ID,			/* id:<vendor>:<product>, EVIOCGID in hex */
+	EMPCD_MATCH_PHYS		/* phys:<EVIOCGPHYS> */
+};
+
+#define EMPCD_INPUT_DIR		"/dev/input"
+
+struct empcd_device
+{
+	struct empcd_device	*next;
+	char			*path;		/* As configured, a path or a match */
+	int			fd;		/* -1 while not attached */
+	dev_t			rdev;		/* Of the attached node */
+	struct empcd_watch	watch;
+	bool			exclusive;
+
+	/* Its mappings, pending is filled by a reload */
+	struct empcd_keymap	*keymap, *pending;
+
+	enum empcd_match	match;
+	const char		*matcharg;	/* Into path */
+	uint16_t		vendor, product;
+
+	/* inotify on /dev/input, or the directory of path, to attach when it appears */
+	struct empcd_watch	hotplug;
+
+	/* Read buffer, a partially read event stays at the front */
+	struct input_event	buf[EMPCD_READ_EVENTS];
+	unsigned int		buflen;
+
+	/* Frame being assembled until the next SYN_REPORT */
+	struct input_event	frame[EMPCD_FRAME_EVENTS];
+	unsigned int		framelen;
+
+	/* SYN_DROPPED seen, ignore everything up to the next SYN_REPORT */
+	bool			syncing;
+
+	/* False for a pipe or file, which need not send SYN_REPORT */
+	bool			evdev;
+
+	/* Frames read this round, dispatched in timestamp order with those of the other devices */
+	struct input_event	ready[EMPCD_READY_EVENTS];
+	unsigned int		readylen, readypos;
+	bool			backlog;	/* Stopped reading for lack of room */
+
+	/* Statistics */
+	uint64_t		reads, events, frames, dropped, attaches, detaches, duplicates;
+};
+
+/* The last dispatched frame, to recognize it coming from another node of the same remote */
+struct empcd_dedup
+{
+	const struct empcd_device	*dev;
+	struct timeval			time;
+	struct input_event		frame[EMPCD_FRAME_EVENTS];
+	unsigned int			len;
+};
+
+/* Parsed "[+|-]<val>[%]" argument, relative values are signed */
+struct empcd_adjust
+{
+	bool			relative;
+	bool			perc;
+	int			val;
+};
+
+/*
+ * MPD actions kept while MPD is unreachable, replayed once it is back
+ * Only touched by the executor. Entries are compacted on the way in,
+ * adj and mode hold the combined volume and pause/random values.
+ */
+struct empcd_offline_action
+{
+	const struct empcd_events	*evt;
+	struct empcd_adjust		adj;		/* mpd_volume */
+	int				mode;		/* mpd_pause/mpd_random: 0 off, 1 on, -1 toggle */
+	struct timespec			at;
+};
+
+#define EMPCD_OFFLINE_SIZE	32
+#define EMPCD_OFFLINE_MAXAGE	60	/* seconds, older ones are not replayed */
+
+struct empcd_offline
+{
+	struct empcd_offline_action	list[EMPCD_OFFLINE_SIZE];
+	unsigned int			count;
+
+	/* Statistics */
+	uint64_t			kept, compacted, replayed, expired;
+};
+
+/* MPD connection state machine, see link_event() */
+enum empcd_link_state
+{
+	EMPCD_LINK_DOWN = 0,		/* Not connected, connect on demand */
+	EMPCD_LINK_CONNECTING,		/* Non-blocking connect() in progress */
+	EMPCD_LINK_WELCOME,		/* Waiting for "OK MPD <version>" */
+	EMPCD_LINK_AUTH,		/* Waiting for the password to be accepted */
+	EMPCD_LINK_READY,
+	EMPCD_LINK_BACKOFF,		/* Waiting for the timer to try again */
+};
+
+/* Reconnect backoff (ms) and the timeout for a single read or write (seconds) */
+#define EMPCD_BACKOFF_MIN	100
+#define EMPCD_BACKOFF_MAX	30000
+#define EMPCD_MPD_TIMEOUT	10
+
+/* Deadlines (ms) for connecting up to ready, a command and a slow command (load, save, update, lists) */
+#define EMPCD_DEADLINE_CONNECT	5000
+#define EMPCD_DEADLINE_CMD	2000
+#define EMPCD_DEADLINE_SLOW	10000
+
+/* An MPD server, "[password@]host" or a socket path plus a port */
+struct empcd_server
+{
+	char			*host, *port;	/* As configured */
+	char			*password;	/* Split off from host */
+	const char		*hostname;
+	unsigned int		iport;
+	char			where[sizeof(((struct sockaddr_un *)0)->sun_path) + 16];	/* For logging */
+};
+
+/*
+ * Commands of newer servers that save a status round-trip,
+ * found through 'commands' when the command connection is ready
+ */
+enum empcd_caps
+{
+	EMPCD_CAP_SEEKCUR	= (1 << 0),	/* seekcur [+|-]<time> (0.17) */
+	EMPCD_CAP_VOLUME	= (1 << 1),	/* volume [+|-]<change> */
+};
+
+struct empcd_link
+{
+	const char		*name;		/* For logging */
+	struct empcd_server	*server;
+	enum empcd_link_state	state;
+	struct _mpd_Connection	*conn;		/* Set from WELCOME onwards */
+	struct empcd_watch	watch;		/* The socket */
+	struct empcd_watch	timer;		/* timerfd for the backoff */
+	struct addrinfo		*addrs, *ai;	/* Cached resolution, address being tried */
+	struct addrinfo		local;		/* addrs for a local socket path */
+	struct sockaddr_un	local_addr;
+	unsigned int		backoff;	/* Next delay in ms */
+	unsigned int		caps;		/* enum empcd_caps, command link only */
+
+	void			(*state_changed)(struct empcd_link *m);
+	void			(*readable)(struct empcd_link *m, uint32_t events);
+
+	/* Statistics */
+	uint64_t		connects, failures;
+};
+
+/*
+ * Circuit breaker for the command connection
+ * Opens after a number of failures in a row, MPD actions then fail
+ * right away until the cooldown has passed. The first action after
+ * that (half-open) decides: success closes it, failure opens it again
+ * with a doubled cooldown.
+ */
+enum empcd_breaker_state
+{
+	EMPCD_BREAKER_CLOSED = 0,
+	EMPCD_BREAKER_OPEN,
+	EMPCD_BREAKER_HALFOPEN,
+};
+
+#define EMPCD_BREAKER_FAILURES		3
+#define EMPCD_BREAKER_COOLDOWN		5000	/* ms */
+#define EMPCD_BREAKER_COOLDOWN_MAX	60000
+
+struct empcd_breaker
+{
+	enum empcd_breaker_state	state;
+	unsigned int			failures;	/* In a row */
+	unsigned int			cooldown;	/* ms, next time it opens */
+	struct timespec			until;		/* End of the current cooldown */
+
+	/* Statistics */
+	uint64_t			trips, rejected;
+};
+
+/*
+ * Named group of MPD servers (mpd_group), eg one per room
+ * Actions mapped to a group are sent to all members at once, then
+ * all answers are collected, thus it takes as long as the slowest.
+ */
+struct empcd_member
+{
+	struct empcd_server	server;
+	struct empcd_link	link;
+};
+
+struct empcd_group
+{
+	struct empcd_group	*next;
+	char			*name;
+	struct empcd_member	*members;
+	unsigned int		count;
+
+	/* Statistics */
+	uint64_t		sent, failed;
+};
+
+/*
+ * Primary (mpd_host) and standby (mpd_standby) servers
+ * With standbys every server gets a probe link that pings it, the
+ * command and status links follow the first healthy one in order.
+ */
+struct empcd_probe
+{
+	struct empcd_link	link;		/* First, the link callbacks get this */
+	bool			healthy, down;	/* Neither till it is known */
+	bool			pending;	/* Ping sent, no answer yet */
+	unsigned int		oks, fails;	/* In a row */
+	struct timespec		sent;
+	unsigned int		rtt;		/* us, last answered ping */
+
+	/* Statistics */
+	uint64_t		probes, failures;
+};
+
+#define EMPCD_SERVERS_MAX	8
+#define EMPCD_PROBE_INTERVAL	500	/* ms, also the time a ping may take */
+#define EMPCD_PROBE_IDLE	8000	/* ms, the interval doubles up to this while all servers are healthy */
+#define EMPCD_PROBE_FAILS	2	/* Failed probes in a row before a server is down */
+#define EMPCD_PROBE_RECOVER	3	/* Good probes in a row before it is up again */
+
+struct empcd_failover
+{
+	struct empcd_server	servers[EMPCD_SERVERS_MAX];	/* [0] is mpd_host */
+	struct empcd_probe	probes[EMPCD_SERVERS_MAX];
+	unsigned int		count, active;
+	struct empcd_watch	timer;
+	unsigned int		interval;	/* ms, the timer is armed with */
+
+	/* Switch in progress, till the command link is ready */
+	bool			switching;
+	struct timespec		started;
+
+	/* Statistics */
+	uint64_t		switches;
+	unsigned int		last_us, max_us;
+};
+
+/* Local mirror of the MPD status */
+struct empcd_status
+{
+	bool			valid;
+	int			state, volume, random, repeat, consume, single;
+	int			song, songid, length;
+	int			elapsed;	/* ms */
+	int			total;		/* s, like MPD has it */
+	struct timespec		at;		/* When elapsed was fetched */
+
+	/* Statistics */
+	uint64_t		hits, misses, refreshes;
 };
 
 /* EV_KEY_UP but signal that there is no repeat; thus, the case where REPEAT and then an UP event happen */
@@ -87,5 +566,9 @@ struct empcd_mapping
 extern struct empcd_mapping key_value_map[];
 extern struct empcd_mapping key_event_map[];
 
+/* benchmark.c */
+int benchmark_latency(const char *host, unsigned int port, const char *password, unsigned int count);
+int benchmark_listing(const char *host, unsigned int port, const char *password, unsigned int count);
+
 #endif /* EMPCD_H */
 
@@ -49,6 +49,7 @@
 #  include <netinet/in.h>
 #  include <arpa/inet.h>
 #  include <sys/socket.h>
+#  include <sys/un.h>
 #  include <netdb.h>
 #endif
 
@@ -238,6 +239,49 @@ static int mpd_connect(mpd_Connection * connection, const char * host, int port,
 }
 #endif /* !MPD_HAVE_GAI */
 
+#ifndef WIN32
+/* a host starting with a '/' is the path of a local (unix domain) socket */
+static int mpd_connect_un(mpd_Connection * connection, const char * path,
+                          float timeout)
+{
+	struct sockaddr_un sun;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
+		         "socket path \"%s\" too long", path);
+		connection->error = MPD_ERROR_UNKHOST;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	connection->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection->sock < 0) {
+		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
+		         "problems creating socket: %s",
+		         strerror(errno));
+		connection->error = MPD_ERROR_SYSTEM;
+		return -1;
+	}
+
+	mpd_setConnectionTimeout(connection, timeout);
+
+	if (do_connect_fail(connection, (struct sockaddr *)&sun, sizeof(sun))) {
+		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
+		         "problems connecting to \"%s\": %s",
+		         path, strerror(errno));
+		connection->error = MPD_ERROR_CONNPORT;
+		closesocket(connection->sock);
+		connection->sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* !WIN32 */
+
 const char * mpdTagItemKeys[MPD_TAG_NUM_OF_ITEM_TYPES] =
 {
 	"Artist",
@@ -265,6 +309,7 @@ static char * mpd_sanitizeArg(const char * arg) {
 	 * use a bit more memory and half running time
 	 */
 	ret = malloc(strlen(arg) * 2 + 1);
+	if(!ret) return NULL;
 
 	c = arg;
 	rc = ret;
@@ -277,20 +322,31 @@ static char * mpd_sanitizeArg(const char * arg) {
 	return ret;
 }
 
-static mpd_ReturnElement * mpd_newReturnElement(const char * name, const char * value)
+/* Return elements are slices into the connection buffer,
+ * they stay valid until the next mpd_getNextReturnElement() */
+static mpd_ReturnElement * mpd_sliceReturnElement(mpd_Connection * connection,
+		char * name, size_t nameLen, char * value, size_t valueLen)
 {
-	mpd_ReturnElement * ret = malloc(sizeof(mpd_ReturnElement));
+	mpd_ReturnElement * ret = &connection->returnSlice;
 
-	ret->name = strdup(name);
-	ret->value = strdup(value);
+	ret->name = name;
+	ret->nameLen = nameLen;
+	ret->value = value;
+	ret->valueLen = valueLen;
 
 	return ret;
 }
 
-static void mpd_freeReturnElement(mpd_ReturnElement * re) {
-	free(re->name);
-	free(re->value);
-	free(re);
+/* compare the name of a return element with a string literal */
+#define mpd_isReturnElement(re, str) \
+	((re)->nameLen == sizeof(str)-1 && memcmp((re)->name,str,sizeof(str)-1)==0)
+
+static char * mpd_dupReturnValue(const mpd_ReturnElement * re) {
+	char * ret = malloc(re->valueLen+1);
+
+	memcpy(ret,re->value,re->valueLen+1);
+
+	return ret;
 }
 
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout) {
@@ -300,6 +356,46 @@ void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout) {
 					    0.5);
 }
 
+void mpd_setDeadline(mpd_Connection * connection, int msec) {
+	if(msec<=0) {
+		connection->deadline.tv_sec = 0;
+		connection->deadline.tv_nsec = 0;
+		return;
+	}
+
+	/* monotonic, a step of the wall clock must not fire or stall it */
+	clock_gettime(CLOCK_MONOTONIC,&connection->deadline);
+	connection->deadline.tv_sec += msec/1000;
+	connection->deadline.tv_nsec += (long)(msec%1000)*1000000;
+	if(connection->deadline.tv_nsec>=1000000000) {
+		connection->deadline.tv_sec++;
+		connection->deadline.tv_nsec -= 1000000000;
+	}
+}
+
+/* how long the next select() may wait: the timeout, or less when
+ * the deadline comes sooner, zero once it has passed */
+static void mpd_waitTime(mpd_Connection * connection, struct timeval * tv) {
+	struct timespec now;
+	long long left;
+
+	*tv = connection->timeout;
+	if(!connection->deadline.tv_sec && !connection->deadline.tv_nsec) return;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	left = (long long)(connection->deadline.tv_sec - now.tv_sec)*1000000 +
+	       (connection->deadline.tv_nsec - now.tv_nsec)/1000;
+	if(left<=0) {
+		timerclear(tv);
+		return;
+	}
+
+	if(left < (long long)tv->tv_sec*1000000 + tv->tv_usec) {
+		tv->tv_sec = left/1000000;
+		tv->tv_usec = left%1000000;
+	}
+}
+
 static int mpd_parseWelcome(mpd_Connection * connection, const char * host, int port,
                             char * rt, char * output) {
 	char * tmp;
@@ -336,16 +432,83 @@ static int mpd_parseWelcome(mpd_Connection * connection, const char * host, int
 	return 0;
 }
 
-mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
-	int err;
-	char * rt;
-	char * output =  NULL;
+/* Make sure there is room to recv() into at the end of the buffer.
+ * Consumed data is dropped by starting over at the beginning, only a
+ * partial line ever gets moved and the buffer only grows for lines
+ * that don't fit. Returns 0 on success. */
+static int mpd_reserveBuffer(mpd_Connection * connection) {
+	char * buffer;
+	int size;
+
+	if(connection->bufstart>=connection->buflen) {
+		connection->buflen = 0;
+		connection->bufstart = 0;
+		connection->buffer[0] = '\0';
+	}
+
+	if(connection->buflen<connection->bufsize) return 0;
+
+	if(connection->bufstart>0) {
+		memmove(connection->buffer,
+				connection->buffer+connection->bufstart,
+				connection->buflen-connection->bufstart+1);
+		connection->buflen-=connection->bufstart;
+		connection->bufstart = 0;
+		if(connection->buflen<connection->bufsize) return 0;
+	}
+
+	if(connection->bufsize>=MPD_BUFFER_MAX_LENGTH) return -1;
+
+	size = connection->bufsize*2;
+	if(size>MPD_BUFFER_MAX_LENGTH) size = MPD_BUFFER_MAX_LENGTH;
+
+	buffer = realloc(connection->buffer,size+1);
+	if(!buffer) return -1;
+
+	connection->buffer = buffer;
+	connection->bufsize = size;
+	return 0;
+}
+
+/* Give memory from long responses back once everything is consumed and
+ * several responses in a row didn't need it, so a long listing now and
+ * then doesn't grow and shrink it every time */
+static void mpd_shrinkBuffer(mpd_Connection * connection) {
+	char * buffer;
+	int peak = connection->bufpeak;
+
+	connection->bufpeak = 0;
+	if(connection->bufsize<=MPD_BUFFER_MIN_LENGTH) return;
+
+	if(peak>MPD_BUFFER_MIN_LENGTH) {
+		connection->bufsmall = 0;
+		return;
+	}
+
+	if(++connection->bufsmall<MPD_BUFFER_SHRINK_AFTER ||
+	   connection->bufstart<connection->buflen) return;
+
+	buffer = realloc(connection->buffer,MPD_BUFFER_MIN_LENGTH+1);
+	if(!buffer) return;
+
+	connection->buffer = buffer;
+	connection->bufsize = MPD_BUFFER_MIN_LENGTH;
+	connection->buflen = 0;
+	connection->bufstart = 0;
+	connection->bufsmall = 0;
+	connection->buffer[0] = '\0';
+}
+
+static mpd_Connection * mpd_allocConnection(void) {
 	mpd_Connection * connection = malloc(sizeof(mpd_Connection));
-	struct timeval tv;
-	fd_set fds;
-	strcpy(connection->buffer,"");
+	if(!connection) return NULL;
+	connection->sock = -1;
+	connection->buffer = malloc(MPD_BUFFER_MIN_LENGTH+1);
+	connection->bufsize = MPD_BUFFER_MIN_LENGTH;
 	connection->buflen = 0;
 	connection->bufstart = 0;
+	connection->bufpeak = 0;
+	connection->bufsmall = 0;
 	strcpy(connection->errorStr,"");
 	connection->error = 0;
 	connection->doneProcessing = 0;
@@ -354,10 +517,44 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	connection->doneListOk = 0;
 	connection->returnElement = NULL;
 	connection->request = NULL;
+	connection->idle = 0;
+	connection->noidle = 0;
+	connection->deadline.tv_sec = 0;
+	connection->deadline.tv_nsec = 0;
+
+	if(!connection->buffer) {
+		/* nothing can be received, every use fails on the error */
+		connection->bufsize = 0;
+		strcpy(connection->errorStr,"out of memory");
+		connection->error = MPD_ERROR_SYSTEM;
+		return connection;
+	}
+	strcpy(connection->buffer,"");
+
+	return connection;
+}
+
+mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
+	int err;
+	char * rt;
+	char * output =  NULL;
+	mpd_Connection * connection = mpd_allocConnection();
+	struct timeval tv;
+	fd_set fds;
+
+	if (!connection || connection->error)
+		return connection;
 
 	if (winsock_dll_error(connection))
 		return connection;
 
+#ifndef WIN32
+	if (host[0] == '/') {
+		if (mpd_connect_un(connection, host, timeout) < 0)
+			return connection;
+	}
+	else
+#endif
 	if (mpd_connect(connection, host, port, timeout) < 0)
 		return connection;
 
@@ -368,9 +565,14 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 		FD_SET(connection->sock,&fds);
 		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv)) == 1) {
 			int readed;
+			if(mpd_reserveBuffer(connection)) {
+				strcpy(connection->errorStr,"buffer overrun");
+				connection->error = MPD_ERROR_NOTMPD;
+				return connection;
+			}
 			readed = recv(connection->sock,
 					&(connection->buffer[connection->buflen]),
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,0);
+					connection->bufsize-connection->buflen,0);
 			if(readed<=0) {
 				snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
 						"problems getting a response from"
@@ -402,17 +604,65 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	}
 
 	*rt = '\0';
-	output = strdup(connection->buffer);
-	strcpy(connection->buffer,rt+1);
-	connection->buflen = strlen(connection->buffer);
+	output = connection->buffer;
+	connection->bufstart = rt - connection->buffer + 1;
 
 	if(mpd_parseWelcome(connection,host,port,rt,output) == 0) connection->doneProcessing = 1;
 
-	free(output);
+	return connection;
+}
+
+mpd_Connection * mpd_newConnectionSocket(int sock, float timeout) {
+	mpd_Connection * connection = mpd_allocConnection();
+
+	if (!connection)
+		return NULL;
+
+	connection->sock = sock;
+	mpd_setConnectionTimeout(connection, timeout);
 
 	return connection;
 }
 
+int mpd_readWelcome(mpd_Connection * connection, const char * host, int port) {
+	char * rt;
+	int readed;
+
+	if(connection->error) return -1;
+
+	while(!(rt = strchr(connection->buffer,'\n'))) {
+		if(mpd_reserveBuffer(connection)) {
+			strcpy(connection->errorStr,"buffer overrun");
+			connection->error = MPD_ERROR_NOTMPD;
+			return -1;
+		}
+		readed = recv(connection->sock,
+				&(connection->buffer[connection->buflen]),
+				connection->bufsize-connection->buflen,
+				MSG_DONTWAIT);
+		if(readed<0 && SENDRECV_ERRNO_IGNORE) return 0;
+		if(readed<=0) {
+			snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+					"problems getting a response from"
+					" \"%s\" on port %i : %s",host,
+					port, readed<0 ? strerror(errno) :
+					"connection closed");
+			connection->error = MPD_ERROR_NORESPONSE;
+			return -1;
+		}
+		connection->buflen+=readed;
+		connection->buffer[connection->buflen] = '\0';
+	}
+
+	*rt = '\0';
+	connection->bufstart = rt - connection->buffer + 1;
+
+	if(mpd_parseWelcome(connection,host,port,rt,connection->buffer)) return -1;
+
+	connection->doneProcessing = 1;
+	return 1;
+}
+
 void mpd_clearError(mpd_Connection * connection) {
 	connection->error = 0;
 	connection->errorStr[0] = '\0';
@@ -420,18 +670,17 @@ void mpd_clearError(mpd_Connection * connection) {
 
 void mpd_closeConnection(mpd_Connection * connection) {
 	closesocket(connection->sock);
-	if(connection->returnElement) free(connection->returnElement);
 	if(connection->request) free(connection->request);
+	free(connection->buffer);
 	free(connection);
 	WSACleanup();
 }
 
-static void mpd_executeCommand(mpd_Connection * connection, const char * command) {
+static void mpd_executeCommandLen(mpd_Connection * connection, const char * command, int commandLen) {
 	int ret;
 	struct timeval tv;
 	fd_set fds;
 	const char * commandPtr = command;
-	int commandLen = strlen(command);
 
 	if(!connection->doneProcessing && !connection->commandList) {
 		strcpy(connection->errorStr,"not done processing current command");
@@ -443,8 +692,7 @@ static void mpd_executeCommand(mpd_Connection * connection, const char * command
 
 	FD_ZERO(&fds);
 	FD_SET(connection->sock,&fds);
-	tv.tv_sec = connection->timeout.tv_sec;
-	tv.tv_usec = connection->timeout.tv_usec;
+	mpd_waitTime(connection,&tv);
 
 	while((ret = select(connection->sock+1,NULL,&fds,NULL,&tv)==1) ||
 			(ret==-1 && SELECT_ERRNO_IGNORE)) {
@@ -479,6 +727,10 @@ static void mpd_executeCommand(mpd_Connection * connection, const char * command
 	}
 }
 
+static void mpd_executeCommand(mpd_Connection * connection, const char * command) {
+	mpd_executeCommandLen(connection,command,strlen(command));
+}
+
 static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	char * output = NULL;
 	char * rt = NULL;
@@ -492,7 +744,6 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	int err;
 	int pos;
 
-	if(connection->returnElement) mpd_freeReturnElement(connection->returnElement);
 	connection->returnElement = NULL;
 
 	if(connection->doneProcessing || (connection->listOks &&
@@ -503,19 +754,11 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 		return;
 	}
 
+next_line:
 	bufferCheck = connection->buffer+connection->bufstart;
 	while(connection->bufstart>=connection->buflen ||
 			!(rt = strchr(bufferCheck,'\n'))) {
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
-			memmove(connection->buffer,
-					connection->buffer+
-					connection->bufstart,
-					connection->buflen-
-					connection->bufstart+1);
-			connection->buflen-=connection->bufstart;
-			connection->bufstart = 0;
-		}
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
+		if(mpd_reserveBuffer(connection)) {
 			strcpy(connection->errorStr,"buffer overrun");
 			connection->error = MPD_ERROR_BUFFEROVERRUN;
 			connection->doneProcessing = 1;
@@ -523,14 +766,13 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 			return;
 		}
 		bufferCheck = connection->buffer+connection->buflen;
-		tv.tv_sec = connection->timeout.tv_sec;
-		tv.tv_usec = connection->timeout.tv_usec;
+		mpd_waitTime(connection,&tv);
 		FD_ZERO(&fds);
 		FD_SET(connection->sock,&fds);
 		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv) == 1)) {
 			readed = recv(connection->sock,
 					connection->buffer+connection->buflen,
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,
+					connection->bufsize-connection->buflen,
 					MSG_DONTWAIT);
 			if(readed<0 && SENDRECV_ERRNO_IGNORE) {
 				continue;
@@ -545,6 +787,8 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 			}
 			connection->buflen+=readed;
 			connection->buffer[connection->buflen] = '\0';
+			if(connection->buflen-connection->bufstart>connection->bufpeak)
+				connection->bufpeak = connection->buflen-connection->bufstart;
 		}
 		else if(err<0 && SELECT_ERRNO_IGNORE) continue;
 		else {
@@ -560,7 +804,18 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	output = connection->buffer+connection->bufstart;
 	connection->bufstart = rt - connection->buffer + 1;
 
+	/* left over of an idle cancelled by noidle, not ours */
+	if(connection->noidle) {
+		if(strcmp(output,"OK")==0 ||
+		   strncmp(output,"ACK",strlen("ACK"))==0) {
+			connection->noidle = 0;
+		}
+		goto next_line;
+	}
+
 	if(strcmp(output,"OK")==0) {
+		connection->idle = 0;
+		mpd_shrinkBuffer(connection);
 		if(connection->listOks > 0) {
 			strcpy(connection->errorStr, "expected more list_OK's");
 			connection->error = 1;
@@ -591,6 +846,8 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 
 		strcpy(connection->errorStr, output);
 		connection->error = MPD_ERROR_ACK;
+		connection->idle = 0;
+		connection->listOks = 0;
 		connection->errorCode = MPD_ACK_ERROR_UNK;
 		connection->errorAt = MPD_ERROR_AT_UNK;
 		connection->doneProcessing = 1;
@@ -615,7 +872,8 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	name[pos] = '\0';
 
 	if(value[0]==' ') {
-		connection->returnElement = mpd_newReturnElement(name,&(value[1]));
+		connection->returnElement = mpd_sliceReturnElement(connection,
+				name,pos,&(value[1]),rt-&(value[1]));
 	}
 	else {
 		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
@@ -650,65 +908,68 @@ void mpd_sendStatusCommand(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"status\n");
 }
 
-mpd_Status * mpd_getStatus(mpd_Connection * connection) {
-	mpd_Status * status;
-
+int mpd_fillStatus(mpd_Connection * connection, mpd_Status * status) {
 	/*mpd_executeCommand(connection,"status\n");
 
-	if(connection->error) return NULL;*/
+	if(connection->error) return -1;*/
 
 	if(connection->doneProcessing || (connection->listOks &&
 	   connection->doneListOk))
 	{
-		return NULL;
+		return -1;
 	}
 
 	if(!connection->returnElement) mpd_getNextReturnElement(connection);
 
-	status = malloc(sizeof(mpd_Status));
 	status->volume = -1;
 	status->repeat = 0;
 	status->random = 0;
+	status->consume = 0;
+	status->single = 0;
 	status->playlist = -1;
 	status->playlistLength = -1;
 	status->state = -1;
 	status->song = 0;
 	status->songid = 0;
 	status->elapsedTime = 0;
+	status->elapsedMs = -1;
 	status->totalTime = 0;
 	status->bitRate = 0;
 	status->sampleRate = 0;
 	status->bits = 0;
 	status->channels = 0;
 	status->crossfade = -1;
-	status->error = NULL;
+	if(status->error) status->error[0] = '\0';
 	status->updatingDb = 0;
 
-	if(connection->error) {
-		free(status);
-		return NULL;
-	}
+	if(connection->error) return -1;
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"volume")==0) {
+		if(mpd_isReturnElement(re,"volume")) {
 			status->volume = atoi(re->value);
 		}
-		else if(strcmp(re->name,"repeat")==0) {
+		else if(mpd_isReturnElement(re,"repeat")) {
 			status->repeat = atoi(re->value);
 		}
-		else if(strcmp(re->name,"random")==0) {
+		else if(mpd_isReturnElement(re,"random")) {
 			status->random = atoi(re->value);
 		}
-		else if(strcmp(re->name,"playlist")==0) {
+		else if(mpd_isReturnElement(re,"consume")) {
+			status->consume = atoi(re->value);
+		}
+		else if(mpd_isReturnElement(re,"single")) {
+			status->single = strcmp(re->value,"0") != 0;
+		}
+		else if(mpd_isReturnElement(re,"playlist")) {
 			status->playlist = strtol(re->value,NULL,10);
 		}
-		else if(strcmp(re->name,"playlistlength")==0) {
+		else if(mpd_isReturnElement(re,"playlistlength")) {
 			status->playlistLength = atoi(re->value);
 		}
-		else if(strcmp(re->name,"bitrate")==0) {
+		else if(mpd_isReturnElement(re,"bitrate")) {
 			status->bitRate = atoi(re->value);
 		}
-		else if(strcmp(re->name,"state")==0) {
+		else if(mpd_isReturnElement(re,"state")) {
 			if(strcmp(re->value,"play")==0) {
 				status->state = MPD_STATUS_STATE_PLAY;
 			}
@@ -722,13 +983,13 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection) {
 				status->state = MPD_STATUS_STATE_UNKNOWN;
 			}
 		}
-		else if(strcmp(re->name,"song")==0) {
+		else if(mpd_isReturnElement(re,"song")) {
 			status->song = atoi(re->value);
 		}
-		else if(strcmp(re->name,"songid")==0) {
+		else if(mpd_isReturnElement(re,"songid")) {
 			status->songid = atoi(re->value);
 		}
-		else if(strcmp(re->name,"time")==0) {
+		else if(mpd_isReturnElement(re,"time")) {
 			char * tok = strchr(re->value,':');
 			/* the second strchr below is a safety check */
 			if (tok && (strchr(tok,0) > (tok+1))) {
@@ -737,16 +998,38 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection) {
 				status->totalTime = atoi(tok+1);
 			}
 		}
-		else if(strcmp(re->name,"error")==0) {
-			status->error = strdup(re->value);
+		else if(mpd_isReturnElement(re,"elapsed")) {
+			/* seconds with up to three decimals */
+			char * tok;
+			int ms = 0, scale = 100;
+			status->elapsedMs = strtol(re->value,&tok,10) * 1000;
+			if (*tok == '.') {
+				for (tok++; *tok >= '0' && *tok <= '9' && scale > 0; tok++, scale /= 10)
+					ms += (*tok - '0') * scale;
+				status->elapsedMs += ms;
+			}
+		}
+		else if(mpd_isReturnElement(re,"error")) {
+			/* the storage only grows, it is reused by the next fill */
+			if(re->valueLen >= status->errorSize) {
+				char * error = realloc(status->error,re->valueLen+1);
+				if(!error) {
+					strcpy(connection->errorStr,"out of memory");
+					connection->error = 1;
+					return -1;
+				}
+				status->error = error;
+				status->errorSize = re->valueLen+1;
+			}
+			memcpy(status->error,re->value,re->valueLen+1);
 		}
-		else if(strcmp(re->name,"xfade")==0) {
+		else if(mpd_isReturnElement(re,"xfade")) {
 			status->crossfade = atoi(re->value);
 		}
-		else if(strcmp(re->name,"updating_db")==0) {
+		else if(mpd_isReturnElement(re,"updating_db")) {
 			status->updatingDb = atoi(re->value);
 		}
-		else if(strcmp(re->name,"audio")==0) {
+		else if(mpd_isReturnElement(re,"audio")) {
 			char * tok = strchr(re->value,':');
 			if (tok && (strchr(tok,0) > (tok+1))) {
 				status->sampleRate = atoi(re->value);
@@ -758,23 +1041,40 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection) {
 		}
 
 		mpd_getNextReturnElement(connection);
-		if(connection->error) {
-			free(status);
-			return NULL;
-		}
+		if(connection->error) return -1;
 	}
 
-	if(connection->error) {
-		free(status);
-		return NULL;
-	}
+	if(connection->error) return -1;
 	else if(status->state<0) {
 		strcpy(connection->errorStr,"state not found");
 		connection->error = 1;
-		free(status);
+		return -1;
+	}
+
+	if(status->elapsedMs<0) status->elapsedMs = status->elapsedTime * 1000;
+
+	return 0;
+}
+
+mpd_Status * mpd_getStatus(mpd_Connection * connection) {
+	mpd_Status * status = malloc(sizeof(mpd_Status));
+
+	if(!status) return NULL;
+
+	status->error = NULL;
+	status->errorSize = 0;
+
+	if(mpd_fillStatus(connection,status) < 0) {
+		mpd_freeStatus(status);
 		return NULL;
 	}
 
+	/* an empty error is no error */
+	if(status->error && !status->error[0]) {
+		free(status->error);
+		status->error = NULL;
+	}
+
 	return status;
 }
 
@@ -783,6 +1083,12 @@ void mpd_freeStatus(mpd_Status * status) {
 	free(status);
 }
 
+void mpd_finishStatus(mpd_Status * status) {
+	if(status->error) free(status->error);
+	status->error = NULL;
+	status->errorSize = 0;
+}
+
 void mpd_sendStatsCommand(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"stats\n");
 }
@@ -817,25 +1123,25 @@ mpd_Stats * mpd_getStats(mpd_Connection * connection) {
 	}
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"artists")==0) {
+		if(mpd_isReturnElement(re,"artists")) {
 			stats->numberOfArtists = atoi(re->value);
 		}
-		else if(strcmp(re->name,"albums")==0) {
+		else if(mpd_isReturnElement(re,"albums")) {
 			stats->numberOfAlbums = atoi(re->value);
 		}
-		else if(strcmp(re->name,"songs")==0) {
+		else if(mpd_isReturnElement(re,"songs")) {
 			stats->numberOfSongs = atoi(re->value);
 		}
-		else if(strcmp(re->name,"uptime")==0) {
+		else if(mpd_isReturnElement(re,"uptime")) {
 			stats->uptime = strtol(re->value,NULL,10);
 		}
-		else if(strcmp(re->name,"db_update")==0) {
+		else if(mpd_isReturnElement(re,"db_update")) {
 			stats->dbUpdateTime = strtol(re->value,NULL,10);
 		}
-		else if(strcmp(re->name,"playtime")==0) {
+		else if(mpd_isReturnElement(re,"playtime")) {
 			stats->playTime = strtol(re->value,NULL,10);
 		}
-		else if(strcmp(re->name,"db_playtime")==0) {
+		else if(mpd_isReturnElement(re,"db_playtime")) {
 			stats->dbPlayTime = strtol(re->value,NULL,10);
 		}
 
@@ -888,6 +1194,7 @@ static void mpd_finishSong(mpd_Song * song) {
 	if(song->date) free(song->date);
 	if(song->genre) free(song->genre);
 	if(song->composer) free(song->composer);
+	if(song->performer) free(song->performer);
 	if(song->disc) free(song->disc);
 	if(song->comment) free(song->comment);
 }
@@ -1020,120 +1327,84 @@ static void mpd_sendInfoCommand(mpd_Connection * connection, char * command) {
 	mpd_executeCommand(connection,command);
 }
 
-mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
-	mpd_InfoEntity * entity = NULL;
-
-	if(connection->doneProcessing || (connection->listOks &&
-	   connection->doneListOk))
-	{
-		return NULL;
-	}
-
-	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+/* where the strings of an entity come from, malloc or an mpd_EntityBuffer */
+typedef char * (*mpd_DupFunction)(void * ctx, const mpd_ReturnElement * re);
 
-	if(connection->returnElement) {
-		if(strcmp(connection->returnElement->name,"file")==0) {
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_SONG;
-			entity->info.song = mpd_newSong();
-			entity->info.song->file =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name,
-					"directory")==0) {
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_DIRECTORY;
-			entity->info.directory = mpd_newDirectory();
-			entity->info.directory->path =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name,"playlist")==0) {
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_PLAYLISTFILE;
-			entity->info.playlistFile = mpd_newPlaylistFile();
-			entity->info.playlistFile->path =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name, "cpos") == 0){
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_SONG;
-			entity->info.song = mpd_newSong();
-			entity->info.song->pos = atoi(connection->returnElement->value);
-		}
-		else {
-			connection->error = 1;
-			strcpy(connection->errorStr,"problem parsing song info");
-			return NULL;
-		}
-	}
-	else return NULL;
+static char * mpd_mallocValue(void * ctx, const mpd_ReturnElement * re) {
+	(void)ctx;
+	return mpd_dupReturnValue(re);
+}
 
+/* the tags following the first element of an entity */
+static void mpd_parseInfoEntity(mpd_Connection * connection,
+		mpd_InfoEntity * entity, mpd_DupFunction dup, void * ctx)
+{
 	mpd_getNextReturnElement(connection);
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
 
-		if(strcmp(re->name,"file")==0) return entity;
-		else if(strcmp(re->name,"directory")==0) return entity;
-		else if(strcmp(re->name,"playlist")==0) return entity;
-		else if(strcmp(re->name,"cpos")==0) return entity;
+		if(mpd_isReturnElement(re,"file")) return;
+		else if(mpd_isReturnElement(re,"directory")) return;
+		else if(mpd_isReturnElement(re,"playlist")) return;
+		else if(mpd_isReturnElement(re,"cpos")) return;
 
 		if(entity->type == MPD_INFO_ENTITY_TYPE_SONG &&
-				strlen(re->value)) {
+				re->valueLen) {
 			if(!entity->info.song->artist &&
-					strcmp(re->name,"Artist")==0) {
-				entity->info.song->artist = strdup(re->value);
+					mpd_isReturnElement(re,"Artist")) {
+				entity->info.song->artist = dup(ctx,re);
 			}
 			else if(!entity->info.song->album &&
-					strcmp(re->name,"Album")==0) {
-				entity->info.song->album = strdup(re->value);
+					mpd_isReturnElement(re,"Album")) {
+				entity->info.song->album = dup(ctx,re);
 			}
 			else if(!entity->info.song->title &&
-					strcmp(re->name,"Title")==0) {
-				entity->info.song->title = strdup(re->value);
+					mpd_isReturnElement(re,"Title")) {
+				entity->info.song->title = dup(ctx,re);
 			}
 			else if(!entity->info.song->track &&
-					strcmp(re->name,"Track")==0) {
-				entity->info.song->track = strdup(re->value);
+					mpd_isReturnElement(re,"Track")) {
+				entity->info.song->track = dup(ctx,re);
 			}
 			else if(!entity->info.song->name &&
-					strcmp(re->name,"Name")==0) {
-				entity->info.song->name = strdup(re->value);
+					mpd_isReturnElement(re,"Name")) {
+				entity->info.song->name = dup(ctx,re);
 			}
 			else if(entity->info.song->time==MPD_SONG_NO_TIME &&
-					strcmp(re->name,"Time")==0) {
+					mpd_isReturnElement(re,"Time")) {
 				entity->info.song->time = atoi(re->value);
 			}
 			else if(entity->info.song->pos==MPD_SONG_NO_NUM &&
-					strcmp(re->name,"Pos")==0) {
+					mpd_isReturnElement(re,"Pos")) {
 				entity->info.song->pos = atoi(re->value);
 			}
 			else if(entity->info.song->id==MPD_SONG_NO_ID &&
-					strcmp(re->name,"Id")==0) {
+					mpd_isReturnElement(re,"Id")) {
 				entity->info.song->id = atoi(re->value);
 			}
 			else if(!entity->info.song->date &&
-					strcmp(re->name, "Date") == 0) {
-				entity->info.song->date = strdup(re->value);
+					mpd_isReturnElement(re,"Date")) {
+				entity->info.song->date = dup(ctx,re);
 			}
 			else if(!entity->info.song->genre &&
-					strcmp(re->name, "Genre") == 0) {
-				entity->info.song->genre = strdup(re->value);
+					mpd_isReturnElement(re,"Genre")) {
+				entity->info.song->genre = dup(ctx,re);
 			}
 			else if(!entity->info.song->composer &&
-					strcmp(re->name, "Composer") == 0) {
-				entity->info.song->composer = strdup(re->value);
+					mpd_isReturnElement(re,"Composer")) {
+				entity->info.song->composer = dup(ctx,re);
 			}
 			else if(!entity->info.song->performer &&
-					strcmp(re->name, "Performer") == 0) {
-				entity->info.song->performer = strdup(re->value);
+					mpd_isReturnElement(re,"Performer")) {
+				entity->info.song->performer = dup(ctx,re);
 			}
 			else if(!entity->info.song->disc &&
-					strcmp(re->name, "Disc") == 0) {
-				entity->info.song->disc = strdup(re->value);
+					mpd_isReturnElement(re,"Disc")) {
+				entity->info.song->disc = dup(ctx,re);
 			}
 			else if(!entity->info.song->comment &&
-					strcmp(re->name, "Comment") == 0) {
-				entity->info.song->comment = strdup(re->value);
+					mpd_isReturnElement(re,"Comment")) {
+				entity->info.song->comment = dup(ctx,re);
 			}
 		}
 		else if(entity->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
@@ -1143,10 +1414,327 @@ mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
 
 		mpd_getNextReturnElement(connection);
 	}
+}
+
+/* the type of the entity the current element starts, -1 when none */
+static int mpd_infoEntityType(mpd_Connection * connection) {
+	if(connection->doneProcessing || (connection->listOks &&
+	   connection->doneListOk))
+	{
+		return -1;
+	}
+
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+	if(!connection->returnElement) return -1;
+
+	if(mpd_isReturnElement(connection->returnElement,"file") ||
+	   mpd_isReturnElement(connection->returnElement,"cpos")) {
+		return MPD_INFO_ENTITY_TYPE_SONG;
+	}
+	if(mpd_isReturnElement(connection->returnElement,"directory")) {
+		return MPD_INFO_ENTITY_TYPE_DIRECTORY;
+	}
+	if(mpd_isReturnElement(connection->returnElement,"playlist")) {
+		return MPD_INFO_ENTITY_TYPE_PLAYLISTFILE;
+	}
+
+	connection->error = 1;
+	strcpy(connection->errorStr,"problem parsing song info");
+	return -1;
+}
+
+/* the first element of an entity, its storage is there already */
+static void mpd_startInfoEntity(mpd_Connection * connection,
+		mpd_InfoEntity * entity, mpd_DupFunction dup, void * ctx)
+{
+	mpd_ReturnElement * re = connection->returnElement;
+
+	if(entity->type == MPD_INFO_ENTITY_TYPE_SONG) {
+		if(mpd_isReturnElement(re,"cpos")) {
+			entity->info.song->pos = atoi(re->value);
+		}
+		else entity->info.song->file = dup(ctx,re);
+	}
+	else if(entity->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		entity->info.directory->path = dup(ctx,re);
+	}
+	else entity->info.playlistFile->path = dup(ctx,re);
+}
+
+mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
+	mpd_InfoEntity * entity;
+	int type = mpd_infoEntityType(connection);
+
+	if(type < 0) return NULL;
+
+	entity = mpd_newInfoEntity();
+	entity->type = type;
+	if(type == MPD_INFO_ENTITY_TYPE_SONG) {
+		entity->info.song = mpd_newSong();
+	}
+	else if(type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		entity->info.directory = mpd_newDirectory();
+	}
+	else entity->info.playlistFile = mpd_newPlaylistFile();
+
+	mpd_startInfoEntity(connection,entity,mpd_mallocValue,NULL);
+	mpd_parseInfoEntity(connection,entity,mpd_mallocValue,NULL);
 
 	return entity;
 }
 
+/* the string slots of the entity in an mpd_EntityBuffer, NULL past the last */
+#define MPD_SONG_STRINGS 12
+
+static char ** mpd_entityString(mpd_EntityBuffer * eb, unsigned int i) {
+	char ** song[MPD_SONG_STRINGS] = {
+		&eb->song.file, &eb->song.artist, &eb->song.title,
+		&eb->song.album, &eb->song.track, &eb->song.name,
+		&eb->song.date, &eb->song.genre, &eb->song.composer,
+		&eb->song.performer, &eb->song.disc, &eb->song.comment
+	};
+
+	if(eb->entity.type == MPD_INFO_ENTITY_TYPE_SONG) {
+		return i < MPD_SONG_STRINGS ? song[i] : NULL;
+	}
+	if(i > 0) return NULL;
+	if(eb->entity.type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		return &eb->directory.path;
+	}
+	return &eb->playlistFile.path;
+}
+
+static char * mpd_bufferValue(void * ctx, const mpd_ReturnElement * re) {
+	mpd_EntityBuffer * eb = ctx;
+	ptrdiff_t off[MPD_SONG_STRINGS];
+	size_t size;
+	char ** str;
+	char * buf;
+	char * ret;
+	unsigned int i;
+
+	if(eb->used+re->valueLen+1 > eb->size) {
+		size = eb->size ? eb->size*2 : 256;
+		while(size < eb->used+re->valueLen+1) size *= 2;
+
+		/* the strings so far move along */
+		for(i = 0; (str = mpd_entityString(eb,i)) != NULL; i++) {
+			off[i] = *str ? *str - eb->buf : -1;
+		}
+
+		buf = realloc(eb->buf,size);
+		if(!buf) return NULL;
+		eb->buf = buf;
+		eb->size = size;
+
+		for(i = 0; (str = mpd_entityString(eb,i)) != NULL; i++) {
+			*str = off[i] < 0 ? NULL : eb->buf + off[i];
+		}
+	}
+
+	ret = eb->buf + eb->used;
+	memcpy(ret,re->value,re->valueLen+1);
+	eb->used += re->valueLen+1;
+
+	return ret;
+}
+
+mpd_InfoEntity * mpd_getNextInfoEntityInto(mpd_Connection * connection,
+		mpd_EntityBuffer * eb)
+{
+	int type = mpd_infoEntityType(connection);
+
+	if(type < 0) return NULL;
+
+	eb->used = 0;
+	eb->entity.type = type;
+	if(type == MPD_INFO_ENTITY_TYPE_SONG) {
+		mpd_initSong(&eb->song);
+		eb->entity.info.song = &eb->song;
+	}
+	else if(type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		mpd_initDirectory(&eb->directory);
+		eb->entity.info.directory = &eb->directory;
+	}
+	else {
+		mpd_initPlaylistFile(&eb->playlistFile);
+		eb->entity.info.playlistFile = &eb->playlistFile;
+	}
+
+	mpd_startInfoEntity(connection,&eb->entity,mpd_bufferValue,eb);
+	mpd_parseInfoEntity(connection,&eb->entity,mpd_bufferValue,eb);
+
+	return &eb->entity;
+}
+
+void mpd_finishEntityBuffer(mpd_EntityBuffer * eb) {
+	if(eb->buf) free(eb->buf);
+	eb->buf = NULL;
+	eb->size = 0;
+	eb->used = 0;
+}
+
+/* a chunk of an mpd_Arena, the objects follow the header */
+struct mpd_ArenaChunk {
+	struct mpd_ArenaChunk * next;
+	size_t size;
+	size_t used;
+};
+
+#define MPD_ARENA_ALIGN		(sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double))
+#define MPD_ARENA_ROUND(x)	(((x) + MPD_ARENA_ALIGN - 1) & ~(MPD_ARENA_ALIGN - 1))
+#define MPD_ARENA_HEADER	MPD_ARENA_ROUND(sizeof(struct mpd_ArenaChunk))
+
+void mpd_initArena(mpd_Arena * arena, size_t chunkSize) {
+	arena->chunks = NULL;
+	arena->current = NULL;
+	arena->chunkSize = chunkSize ? chunkSize : MPD_ARENA_CHUNK;
+	arena->allocated = 0;
+}
+
+void * mpd_arenaAlloc(mpd_Arena * arena, size_t size) {
+	struct mpd_ArenaChunk * chunk = arena->current;
+	struct mpd_ArenaChunk * fresh;
+	size_t chunkSize;
+	void * ret;
+
+	size = MPD_ARENA_ROUND(size);
+
+	/* after a reset the chunks of the previous response are used again */
+	while(chunk && chunk->used + size > chunk->size && chunk->next) {
+		chunk = chunk->next;
+		chunk->used = 0;
+	}
+
+	if(!chunk || chunk->used + size > chunk->size) {
+		chunkSize = size > arena->chunkSize ? size : arena->chunkSize;
+		fresh = malloc(MPD_ARENA_HEADER + chunkSize);
+		if(!fresh) return NULL;
+
+		fresh->size = chunkSize;
+		fresh->used = 0;
+		arena->allocated += chunkSize;
+
+		if(chunk) {
+			fresh->next = chunk->next;
+			chunk->next = fresh;
+		}
+		else {
+			fresh->next = arena->chunks;
+			arena->chunks = fresh;
+		}
+		chunk = fresh;
+	}
+
+	arena->current = chunk;
+	ret = (char *)chunk + MPD_ARENA_HEADER + chunk->used;
+	chunk->used += size;
+
+	return ret;
+}
+
+void mpd_resetArena(mpd_Arena * arena) {
+	arena->current = arena->chunks;
+	if(arena->current) arena->current->used = 0;
+}
+
+void mpd_finishArena(mpd_Arena * arena) {
+	struct mpd_ArenaChunk * chunk;
+
+	while((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+
+	arena->current = NULL;
+	arena->allocated = 0;
+}
+
+static char * mpd_arenaValue(void * ctx, const mpd_ReturnElement * re) {
+	char * ret = mpd_arenaAlloc(ctx,re->valueLen+1);
+
+	if(ret) memcpy(ret,re->value,re->valueLen+1);
+	return ret;
+}
+
+static char * mpd_arenaStrdup(mpd_Arena * arena, const char * str) {
+	char * ret;
+
+	if(!str) return NULL;
+
+	ret = mpd_arenaAlloc(arena,strlen(str)+1);
+	if(ret) strcpy(ret,str);
+	return ret;
+}
+
+mpd_InfoEntity * mpd_getNextInfoEntityArena(mpd_Connection * connection,
+		mpd_Arena * arena)
+{
+	mpd_InfoEntity * entity;
+	void * info;
+	int type = mpd_infoEntityType(connection);
+
+	if(type < 0) return NULL;
+
+	entity = mpd_arenaAlloc(arena,sizeof(*entity));
+	if(type == MPD_INFO_ENTITY_TYPE_SONG) {
+		info = mpd_arenaAlloc(arena,sizeof(mpd_Song));
+	}
+	else if(type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		info = mpd_arenaAlloc(arena,sizeof(mpd_Directory));
+	}
+	else info = mpd_arenaAlloc(arena,sizeof(mpd_PlaylistFile));
+
+	if(!entity || !info) {
+		strcpy(connection->errorStr,"out of memory");
+		connection->error = 1;
+		return NULL;
+	}
+
+	entity->type = type;
+	if(type == MPD_INFO_ENTITY_TYPE_SONG) {
+		entity->info.song = info;
+		mpd_initSong(entity->info.song);
+	}
+	else if(type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		entity->info.directory = info;
+		mpd_initDirectory(entity->info.directory);
+	}
+	else {
+		entity->info.playlistFile = info;
+		mpd_initPlaylistFile(entity->info.playlistFile);
+	}
+
+	mpd_startInfoEntity(connection,entity,mpd_arenaValue,arena);
+	mpd_parseInfoEntity(connection,entity,mpd_arenaValue,arena);
+
+	return entity;
+}
+
+mpd_Song * mpd_songDupArena(mpd_Arena * arena, const mpd_Song * song) {
+	mpd_Song * ret = mpd_arenaAlloc(arena,sizeof(*ret));
+
+	if(!ret) return NULL;
+
+	ret->file = mpd_arenaStrdup(arena,song->file);
+	ret->artist = mpd_arenaStrdup(arena,song->artist);
+	ret->album = mpd_arenaStrdup(arena,song->album);
+	ret->title = mpd_arenaStrdup(arena,song->title);
+	ret->track = mpd_arenaStrdup(arena,song->track);
+	ret->name = mpd_arenaStrdup(arena,song->name);
+	ret->date = mpd_arenaStrdup(arena,song->date);
+	ret->genre = mpd_arenaStrdup(arena,song->genre);
+	ret->composer = mpd_arenaStrdup(arena,song->composer);
+	ret->performer = mpd_arenaStrdup(arena,song->performer);
+	ret->disc = mpd_arenaStrdup(arena,song->disc);
+	ret->comment = mpd_arenaStrdup(arena,song->comment);
+	ret->time = song->time;
+	ret->pos = song->pos;
+	ret->id = song->id;
+
+	return ret;
+}
+
 static char * mpd_getNextReturnElementNamed(mpd_Connection * connection,
 		const char * name)
 {
@@ -1160,7 +1748,7 @@ static char * mpd_getNextReturnElementNamed(mpd_Connection * connection,
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
 
-		if(strcmp(re->name,name)==0) return strdup(re->value);
+		if(strcmp(re->name,name)==0) return mpd_dupReturnValue(re);
 		mpd_getNextReturnElement(connection);
 	}
 
@@ -1186,31 +1774,27 @@ char * mpd_getNextAlbum(mpd_Connection * connection) {
 }
 
 void mpd_sendPlaylistInfoCommand(mpd_Connection * connection, int songPos) {
-	char * string = malloc(strlen("playlistinfo")+25);
-	sprintf(string,"playlistinfo \"%i\"\n",songPos);
+	char string[64];
+	snprintf(string,sizeof(string),"playlistinfo \"%i\"\n",songPos);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendPlaylistIdCommand(mpd_Connection * connection, int id) {
-	char * string = malloc(strlen("playlistid")+25);
-	sprintf(string, "playlistid \"%i\"\n", id);
+	char string[64];
+	snprintf(string,sizeof(string), "playlistid \"%i\"\n", id);
 	mpd_sendInfoCommand(connection, string);
-	free(string);
 }
 
 void mpd_sendPlChangesCommand(mpd_Connection * connection, long long playlist) {
-	char * string = malloc(strlen("plchanges")+25);
-	sprintf(string,"plchanges \"%lld\"\n",playlist);
+	char string[64];
+	snprintf(string,sizeof(string),"plchanges \"%lld\"\n",playlist);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendPlChangesPosIdCommand(mpd_Connection * connection, long long playlist) {
-	char * string = malloc(strlen("plchangesposid")+25);
-	sprintf(string,"plchangesposid \"%lld\"\n",playlist);
+	char string[64];
+	snprintf(string,sizeof(string),"plchangesposid \"%lld\"\n",playlist);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendListallCommand(mpd_Connection * connection, const char * dir) {
@@ -1316,17 +1900,15 @@ int mpd_sendAddIdCommand(mpd_Connection *connection, const char *file)
 }
 
 void mpd_sendDeleteCommand(mpd_Connection * connection, int songPos) {
-	char * string = malloc(strlen("delete")+25);
-	sprintf(string,"delete \"%i\"\n",songPos);
+	char string[64];
+	snprintf(string,sizeof(string),"delete \"%i\"\n",songPos);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendDeleteIdCommand(mpd_Connection * connection, int id) {
-	char * string = malloc(strlen("deleteid")+25);
-	sprintf(string, "deleteid \"%i\"\n", id);
+	char string[64];
+	snprintf(string,sizeof(string), "deleteid \"%i\"\n", id);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendSaveCommand(mpd_Connection * connection, const char * name) {
@@ -1365,17 +1947,19 @@ void mpd_sendClearCommand(mpd_Connection * connection) {
 }
 
 void mpd_sendPlayCommand(mpd_Connection * connection, int songPos) {
-	char * string = malloc(strlen("play")+25);
-	sprintf(string,"play \"%i\"\n",songPos);
+	char string[64];
+	snprintf(string,sizeof(string),"play \"%i\"\n",songPos);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendPlayIdCommand(mpd_Connection * connection, int id) {
-	char * string = malloc(strlen("playid")+25);
-	sprintf(string,"playid \"%i\"\n",id);
+	char string[64];
+	snprintf(string,sizeof(string),"playid \"%i\"\n",id);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
+}
+
+void mpd_sendPingCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"ping\n");
 }
 
 void mpd_sendStopCommand(mpd_Connection * connection) {
@@ -1383,10 +1967,37 @@ void mpd_sendStopCommand(mpd_Connection * connection) {
 }
 
 void mpd_sendPauseCommand(mpd_Connection * connection, int pauseMode) {
-	char * string = malloc(strlen("pause")+25);
-	sprintf(string,"pause \"%i\"\n",pauseMode);
+	char string[64];
+	snprintf(string,sizeof(string),"pause \"%i\"\n",pauseMode);
 	mpd_executeCommand(connection,string);
-	free(string);
+}
+
+char * mpd_renderCommand(const char * command, const char * arg) {
+	char * sArg;
+	char * string;
+
+	if(!arg) {
+		string = malloc(strlen(command)+2);
+		if(string) sprintf(string,"%s\n",command);
+		return string;
+	}
+
+	sArg = mpd_sanitizeArg(arg);
+	if(!sArg) return NULL;
+
+	string = malloc(strlen(command)+strlen(sArg)+5);
+	if(string) sprintf(string,"%s \"%s\"\n",command,sArg);
+	free(sArg);
+
+	return string;
+}
+
+void mpd_sendRawCommand(mpd_Connection * connection, const char * line, size_t len) {
+	mpd_executeCommandLen(connection,line,(int)len);
+}
+
+void mpd_sendTogglePauseCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"pause\n");
 }
 
 void mpd_sendNextCommand(mpd_Connection * connection) {
@@ -1394,45 +2005,45 @@ void mpd_sendNextCommand(mpd_Connection * connection) {
 }
 
 void mpd_sendMoveCommand(mpd_Connection * connection, int from, int to) {
-	char * string = malloc(strlen("move")+25);
-	sprintf(string,"move \"%i\" \"%i\"\n",from,to);
+	char string[64];
+	snprintf(string,sizeof(string),"move \"%i\" \"%i\"\n",from,to);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendMoveIdCommand(mpd_Connection * connection, int id, int to) {
-	char * string = malloc(strlen("moveid")+25);
-	sprintf(string, "moveid \"%i\" \"%i\"\n", id, to);
+	char string[64];
+	snprintf(string,sizeof(string), "moveid \"%i\" \"%i\"\n", id, to);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendSwapCommand(mpd_Connection * connection, int song1, int song2) {
-	char * string = malloc(strlen("swap")+25);
-	sprintf(string,"swap \"%i\" \"%i\"\n",song1,song2);
+	char string[64];
+	snprintf(string,sizeof(string),"swap \"%i\" \"%i\"\n",song1,song2);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendSwapIdCommand(mpd_Connection * connection, int id1, int id2) {
-	char * string = malloc(strlen("swapid")+25);
-	sprintf(string, "swapid \"%i\" \"%i\"\n", id1, id2);
+	char string[64];
+	snprintf(string,sizeof(string), "swapid \"%i\" \"%i\"\n", id1, id2);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendSeekCommand(mpd_Connection * connection, int song, int time) {
-	char * string = malloc(strlen("seek")+25);
-	sprintf(string,"seek \"%i\" \"%i\"\n",song,time);
+	char string[64];
+	snprintf(string,sizeof(string),"seek \"%i\" \"%i\"\n",song,time);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendSeekIdCommand(mpd_Connection * connection, int id, int time) {
-	char * string = malloc(strlen("seekid")+25);
-	sprintf(string,"seekid \"%i\" \"%i\"\n",id,time);
+	char string[64];
+	snprintf(string,sizeof(string),"seekid \"%i\" \"%i\"\n",id,time);
+	mpd_sendInfoCommand(connection,string);
+}
+
+void mpd_sendSeekCurCommand(mpd_Connection * connection, int time, int relative) {
+	char string[32];
+	snprintf(string,sizeof(string),relative ? "seekcur \"%+i\"\n" : "seekcur \"%i\"\n",time);
 	mpd_sendInfoCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendUpdateCommand(mpd_Connection * connection, char * path) {
@@ -1462,38 +2073,33 @@ void mpd_sendPrevCommand(mpd_Connection * connection) {
 }
 
 void mpd_sendRepeatCommand(mpd_Connection * connection, int repeatMode) {
-	char * string = malloc(strlen("repeat")+25);
-	sprintf(string,"repeat \"%i\"\n",repeatMode);
+	char string[64];
+	snprintf(string,sizeof(string),"repeat \"%i\"\n",repeatMode);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendRandomCommand(mpd_Connection * connection, int randomMode) {
-	char * string = malloc(strlen("random")+25);
-	sprintf(string,"random \"%i\"\n",randomMode);
+	char string[64];
+	snprintf(string,sizeof(string),"random \"%i\"\n",randomMode);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendSetvolCommand(mpd_Connection * connection, int volumeChange) {
-	char * string = malloc(strlen("setvol")+25);
-	sprintf(string,"setvol \"%i\"\n",volumeChange);
+	char string[64];
+	snprintf(string,sizeof(string),"setvol \"%i\"\n",volumeChange);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendVolumeCommand(mpd_Connection * connection, int volumeChange) {
-	char * string = malloc(strlen("volume")+25);
-	sprintf(string,"volume \"%i\"\n",volumeChange);
+	char string[64];
+	snprintf(string,sizeof(string),"volume \"%i\"\n",volumeChange);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendCrossfadeCommand(mpd_Connection * connection, int seconds) {
-	char * string = malloc(strlen("crossfade")+25);
-	sprintf(string,"crossfade \"%i\"\n",seconds);
+	char string[64];
+	snprintf(string,sizeof(string),"crossfade \"%i\"\n",seconds);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendPasswordCommand(mpd_Connection * connection, const char * pass) {
@@ -1536,6 +2142,69 @@ void mpd_sendCommandListEnd(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"command_list_end\n");
 }
 
+void mpd_sendIdleCommand(mpd_Connection * connection, const char * subsystems) {
+	char string[128];
+	char * big;
+
+	if(!subsystems) {
+		mpd_executeCommand(connection,"idle\n");
+	}
+	else if(strlen(subsystems)+7 <= sizeof(string)) {
+		/* this is sent every time a client parks, keep it off the heap */
+		sprintf(string,"idle %s\n",subsystems);
+		mpd_executeCommand(connection,string);
+	}
+	else {
+		big = malloc(strlen("idle")+strlen(subsystems)+3);
+		if(!big) {
+			strcpy(connection->errorStr,"out of memory");
+			connection->error = 1;
+			return;
+		}
+		sprintf(big,"idle %s\n",subsystems);
+		mpd_executeCommand(connection,big);
+		free(big);
+	}
+
+	if(!connection->error) connection->idle = 1;
+}
+
+void mpd_sendNoIdleCommand(mpd_Connection * connection) {
+	if(!connection->idle) return;
+
+	/* the idle is still outstanding, allow noidle to be sent anyway */
+	connection->doneProcessing = 1;
+	mpd_executeCommand(connection,"noidle\n");
+	connection->idle = 0;
+	if(connection->error) return;
+
+	/* the caller can send the next command, its response follows the idle's */
+	connection->noidle = 1;
+	connection->doneProcessing = 1;
+}
+
+char * mpd_getNextChanged(mpd_Connection * connection) {
+	return mpd_getNextReturnElementNamed(connection,"changed");
+}
+
+const char * mpd_getNextChangedValue(mpd_Connection * connection) {
+	if(connection->doneProcessing || (connection->listOks &&
+				connection->doneListOk))
+	{
+		return NULL;
+	}
+
+	mpd_getNextReturnElement(connection);
+	while(connection->returnElement) {
+		if(mpd_isReturnElement(connection->returnElement,"changed")) {
+			return connection->returnElement->value;
+		}
+		mpd_getNextReturnElement(connection);
+	}
+
+	return NULL;
+}
+
 void mpd_sendOutputsCommand(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"outputs\n");
 }
@@ -1560,14 +2229,14 @@ mpd_OutputEntity * mpd_getNextOutput(mpd_Connection * connection) {
 
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"outputid")==0) {
+		if(mpd_isReturnElement(re,"outputid")) {
 			if(output!=NULL && output->id>=0) return output;
 			output->id = atoi(re->value);
 		}
-		else if(strcmp(re->name,"outputname")==0) {
-			output->name = strdup(re->value);
+		else if(mpd_isReturnElement(re,"outputname")) {
+			output->name = mpd_dupReturnValue(re);
 		}
-		else if(strcmp(re->name,"outputenabled")==0) {
+		else if(mpd_isReturnElement(re,"outputenabled")) {
 			output->enabled = atoi(re->value);
 		}
 
@@ -1583,17 +2252,15 @@ mpd_OutputEntity * mpd_getNextOutput(mpd_Connection * connection) {
 }
 
 void mpd_sendEnableOutputCommand(mpd_Connection * connection, int outputId) {
-	char * string = malloc(strlen("enableoutput")+25);
-	sprintf(string,"enableoutput \"%i\"\n",outputId);
+	char string[64];
+	snprintf(string,sizeof(string),"enableoutput \"%i\"\n",outputId);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_sendDisableOutputCommand(mpd_Connection * connection, int outputId) {
-	char * string = malloc(strlen("disableoutput")+25);
-	sprintf(string,"disableoutput \"%i\"\n",outputId);
+	char string[64];
+	snprintf(string,sizeof(string),"disableoutput \"%i\"\n",outputId);
 	mpd_executeCommand(connection,string);
-	free(string);
 }
 
 void mpd_freeOutputElement(mpd_OutputEntity * output) {
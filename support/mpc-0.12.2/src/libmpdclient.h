@@ -38,8 +38,14 @@
 #endif
 
 #include <sys/time.h>
+#include <time.h>
 #include <stdarg.h>
-#define MPD_BUFFER_MAX_LENGTH	50000
+#include <stddef.h>
+/* the receive buffer starts small and grows up to the maximum for long lines,
+ * it shrinks again after that many responses in a row fit the minimum */
+#define MPD_BUFFER_MIN_LENGTH	1024
+#define MPD_BUFFER_MAX_LENGTH	(1024*1024)
+#define MPD_BUFFER_SHRINK_AFTER	16
 #define MPD_ERRORSTR_MAX_LENGTH	1000
 #define MPD_WELCOME_MESSAGE	"OK MPD "
 
@@ -95,10 +101,14 @@ typedef enum mpd_TagItems
 
 extern const char * mpdTagItemKeys[MPD_TAG_NUM_OF_ITEM_TYPES];
 
-/* internal stuff don't touch this struct */
+/* internal stuff don't touch this struct
+ * name and value point into the connection buffer and are
+ * only valid until the next line is read */
 typedef struct _mpd_ReturnElement {
 	char * name;
+	size_t nameLen;
 	char * value;
+	size_t valueLen;
 } mpd_ReturnElement;
 
 /* mpd_Connection
@@ -116,28 +126,61 @@ typedef struct _mpd_Connection {
 	int error;
 	/* DON'T TOUCH any of the rest of this stuff */
 	int sock;
-	char buffer[MPD_BUFFER_MAX_LENGTH+1];
+	char * buffer;
+	int bufsize;
 	int buflen;
 	int bufstart;
+	/* most buffered at once during this response and the number of
+	 * responses since the last that needed more than the minimum */
+	int bufpeak;
+	int bufsmall;
 	int doneProcessing;
 	int listOks;
 	int doneListOk;
 	int commandList;
 	mpd_ReturnElement * returnElement;
+	mpd_ReturnElement returnSlice;
 	struct timeval timeout;
+	/* absolute on CLOCK_MONOTONIC, commands fail with MPD_ERROR_TIMEOUT
+	 * after it, zero = none */
+	struct timespec deadline;
 	char *request;
+	/* 1 while an idle command is outstanding */
+	int idle;
+	/* the response of an idle cancelled by noidle still has to be skipped */
+	int noidle;
 } mpd_Connection;
 
 /* mpd_newConnection
  * use this to open a new connection
+ * _host_ can also be the path of a local socket (starting with a '/'),
+ * _port_ is ignored then
  * you should use mpd_closeConnection, when your done with the connection,
  * even if an error has occurred
  * _timeout_ is the connection timeout period in seconds
  */
 mpd_Connection * mpd_newConnection(const char * host, int port, float timeout);
 
+/* mpd_newConnectionSocket
+ * wraps an already connected (possibly non-blocking) socket, for callers
+ * that do the connect() themselves. mpd_readWelcome has to be called
+ * whenever the socket is readable until it returns non-zero:
+ * 1 when the welcome was received, -1 on error, 0 when it needs more data.
+ * _host_ and _port_ are only used for error messages
+ */
+mpd_Connection * mpd_newConnectionSocket(int sock, float timeout);
+
+int mpd_readWelcome(mpd_Connection * connection, const char * host, int port);
+
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout);
 
+/* mpd_setDeadline
+ * limit the total time sending and answering the next command(s) may
+ * take to _msec_ from now, instead of the timeout per read or write.
+ * 0 removes the deadline
+ */
+void mpd_setDeadline(mpd_Connection * connection, int msec);
+
 /* mpd_closeConnection
  * use this to close a connection and free'ing subsequent memory
  */
@@ -169,6 +212,10 @@ typedef struct mpd_Status {
 	int repeat;
 	/* 1 if random is on, 0 otherwise */
 	int random;
+	/* 1 if consume is on, 0 otherwise */
+	int consume;
+	/* 1 if single (or oneshot) is on, 0 otherwise */
+	int single;
 	/* playlist length */
 	int playlistLength;
 	/* playlist, use this to determine when the playlist has changed */
@@ -188,6 +235,9 @@ typedef struct mpd_Status {
 	 * song
 	 */
 	int elapsedTime;
+	/* the same in milliseconds, from "elapsed" on MPD 0.16 and later,
+	 * elapsedTime * 1000 before */
+	int elapsedMs;
 	/* length in seconds of the currently playing/paused song */
 	int totalTime;
 	/* current bit rate in kbs */
@@ -202,6 +252,8 @@ typedef struct mpd_Status {
 	int updatingDb;
 	/* error */
 	char * error;
+	/* size of the storage error points to, for mpd_fillStatus */
+	size_t errorSize;
 } mpd_Status;
 
 void mpd_sendStatusCommand(mpd_Connection * connection);
@@ -217,6 +269,20 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection);
  */
 void mpd_freeStatus(mpd_Status * status);
 
+/* mpd_fillStatus
+ * like mpd_getStatus, but fills a status owned by the caller, which
+ * does not allocate anything unless MPD reports an error longer than
+ * any before. Zero the status before the first use, error then holds
+ * an empty string instead of NULL when there is none.
+ * returns 0 on success, -1 on failure (see connection->error)
+ */
+int mpd_fillStatus(mpd_Connection * connection, mpd_Status * status);
+
+/* mpd_finishStatus
+ * free's the storage mpd_fillStatus allocated, not the status itself
+ */
+void mpd_finishStatus(mpd_Status * status);
+
 typedef struct _mpd_Stats {
 	int numberOfArtists;
 	int numberOfAlbums;
@@ -387,6 +453,66 @@ void mpd_freeInfoEntity(mpd_InfoEntity * entity);
 /* use this function to loop over after calling Info/Listall functions */
 mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection);
 
+/* mpd_EntityBuffer
+ * caller owned storage for mpd_getNextInfoEntityInto, zero it before the
+ * first use and release it with mpd_finishEntityBuffer
+ */
+typedef struct mpd_EntityBuffer {
+	mpd_InfoEntity entity;
+	mpd_Song song;
+	mpd_Directory directory;
+	mpd_PlaylistFile playlistFile;
+	/* the strings of the entity, this only grows */
+	char * buf;
+	size_t size;
+	size_t used;
+} mpd_EntityBuffer;
+
+/* like mpd_getNextInfoEntity, but fills _eb_ and returns &eb->entity,
+ * which stays valid until the next call. Once the buffer is as large
+ * as the largest entity this doesn't allocate anything.
+ */
+mpd_InfoEntity * mpd_getNextInfoEntityInto(mpd_Connection * connection,
+		mpd_EntityBuffer * eb);
+
+void mpd_finishEntityBuffer(mpd_EntityBuffer * eb);
+
+/* mpd_Arena
+ * bump allocator for the entities of a whole response (listallinfo,
+ * search, plchanges): objects are carved from a chain of chunks and
+ * are never freed one by one, mpd_resetArena releases all of them at
+ * once and keeps the chunks for the next response.
+ */
+struct mpd_ArenaChunk;
+
+typedef struct mpd_Arena {
+	struct mpd_ArenaChunk * chunks;
+	struct mpd_ArenaChunk * current;
+	size_t chunkSize;
+	/* bytes in chunks, for statistics */
+	size_t allocated;
+} mpd_Arena;
+
+#define MPD_ARENA_CHUNK		(64 * 1024)
+
+/* _chunkSize_ 0 uses MPD_ARENA_CHUNK, larger objects get a chunk of their own */
+void mpd_initArena(mpd_Arena * arena, size_t chunkSize);
+
+void * mpd_arenaAlloc(mpd_Arena * arena, size_t size);
+
+void mpd_resetArena(mpd_Arena * arena);
+
+void mpd_finishArena(mpd_Arena * arena);
+
+/* like mpd_getNextInfoEntity, the entity and everything it points to
+ * live in _arena_ until it is reset, don't mpd_freeInfoEntity() it
+ */
+mpd_InfoEntity * mpd_getNextInfoEntityArena(mpd_Connection * connection,
+		mpd_Arena * arena);
+
+/* mpd_songDup into _arena_, NULL when out of memory */
+mpd_Song * mpd_songDupArena(mpd_Arena * arena, const mpd_Song * song);
+
 /* fetches the currently seeletect song (the song referenced by status->song
  * and status->songid*/
 void mpd_sendCurrentSongCommand(mpd_Connection * connection);
@@ -475,8 +601,24 @@ void mpd_sendPlayIdCommand(mpd_Connection * connection, int songNum);
 
 void mpd_sendStopCommand(mpd_Connection * connection);
 
+/* mpd_renderCommand
+ * returns the protocol line for _command_ with the (optional) argument
+ * quoted and escaped, to be sent later with mpd_sendRawCommand.
+ * The caller frees it, NULL when out of memory.
+ */
+char *mpd_renderCommand(const char * command, const char * arg);
+
+/* sends _len_ bytes of a complete protocol line (or lines) as is */
+void mpd_sendRawCommand(mpd_Connection * connection, const char * line, size_t len);
+
+/* does nothing, useful for keeping a connection alive or measuring latency */
+void mpd_sendPingCommand(mpd_Connection * connection);
+
 void mpd_sendPauseCommand(mpd_Connection * connection, int pauseMode);
 
+/* pause without a mode, MPD toggles between play and pause itself */
+void mpd_sendTogglePauseCommand(mpd_Connection * connection);
+
 void mpd_sendNextCommand(mpd_Connection * connection);
 
 void mpd_sendPrevCommand(mpd_Connection * connection);
@@ -493,6 +635,9 @@ void mpd_sendSeekCommand(mpd_Connection * connection, int song, int time);
 
 void mpd_sendSeekIdCommand(mpd_Connection * connection, int song, int time);
 
+/* seek in the current song (MPD 0.17), _time_ is an offset when _relative_ */
+void mpd_sendSeekCurCommand(mpd_Connection * connection, int time, int relative);
+
 void mpd_sendRepeatCommand(mpd_Connection * connection, int repeatMode);
 
 void mpd_sendRandomCommand(mpd_Connection * connection, int randomMode);
@@ -528,6 +673,29 @@ void mpd_sendCommandListEnd(mpd_Connection * connection);
  * returns -1 if it advanced to an OK or ACK */
 int mpd_nextListOkCommand(mpd_Connection * connection);
 
+/* IDLE STUFF */
+
+/* mpd_sendIdleCommand
+ * waits for changes in the given subsystems (space separated, NULL for all)
+ * the connection stays busy until mpd reports a change, fetch the changed
+ * subsystems with mpd_getNextChanged() once the socket becomes readable
+ */
+void mpd_sendIdleCommand(mpd_Connection * connection, const char * subsystems);
+
+/* mpd_sendNoIdleCommand
+ * cancels an outstanding idle, the connection can be used for a new
+ * command right away, the response of the idle is skipped when reading
+ * the response of that next command, thus no extra round-trip is needed
+ */
+void mpd_sendNoIdleCommand(mpd_Connection * connection);
+
+/* returns the next changed subsystem after an idle, be sure to free it,
+ * NULL when there are no more */
+char * mpd_getNextChanged(mpd_Connection * connection);
+
+/* like mpd_getNextChanged, without a copy: valid until the next call */
+const char * mpd_getNextChangedValue(mpd_Connection * connection);
+
 typedef struct _mpd_OutputEntity {
 	int id;
 	char * name;